@@ -0,0 +1,51 @@
+#ifndef RFID_FLIGHT_H
+#define RFID_FLIGHT_H
+
+#include <stdint.h>
+
+/*
+ * Flight recorder dump written by rfid_reader (-F <file>, print with -X).
+
+ rfid_reader keeps the last frames exchanged with its readers in memory at
+ all times and writes them out on SIGUSR1, on a crash and when a reader
+ goes dead. The file is a struct rfid_flight_header followed by `records`
+ records, oldest first. A record is an OUT frame as submitted, an IN frame
+ as completed (actual_length bytes) or a failed transfer (status set,
+ len 0 for a failed OUT). Records being written while the dump was taken
+ may be torn.
+*/
+
+#define RFID_FLIGHT_MAGIC           0x52464652      /* "RFFR" */
+#define RFID_FLIGHT_VERSION         1
+
+/* rfid_flight_header.reason */
+#define RFID_FLIGHT_SIGNAL          1       /* SIGUSR1 */
+#define RFID_FLIGHT_CRASH           2       /* fatal signal, see signal */
+#define RFID_FLIGHT_DEAD            3       /* a reader stopped answering */
+
+/* rfid_flight_record.dir */
+#define RFID_FLIGHT_OUT             0x01
+#define RFID_FLIGHT_IN              0x02
+
+struct rfid_flight_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t records;
+    uint64_t total;             /* frames recorded since start */
+    uint64_t dump_ns;           /* CLOCK_MONOTONIC */
+    uint32_t reason;
+    uint32_t signal;
+};
+
+struct rfid_flight_record {
+    uint64_t timestamp_ns;      /* CLOCK_MONOTONIC */
+    uint32_t reader;
+    uint8_t dir;
+    uint8_t status;             /* libusb_transfer_status, 0: completed */
+    uint8_t len;
+    uint8_t pad;
+    uint8_t data[48];
+};
+
+#endif
@@ -1,12 +1,35 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include "libusb.h"
+#include "rfid_flight.h"
+#include "rfid_ring.h"
+#include "rfid_server.h"
+#ifdef RFID_SIM
+#include "sim_usb.h"
+#define SIM_OPTIONS     "B:L:"
+#else
+#define SIM_OPTIONS     ""
+#endif
 
 #define AUTO_FORMAT     0
 #define T5577_FORMAT    1
@@ -23,228 +46,4738 @@
 #define MESSAGE_STRUCTURE_SIZE	5
 
 /* Commands (from computer) */
+#define CMD_GET_SUPPORT         0x00
+#define CMD_TEST_DEVICE         0x01
 #define CMD_BUZZER              0x03
 #define CMD_EM4100ID_READ       0x10
+#define CMD_T5557_BLOCK_WRITE   0x12
 #define CMD_EM4305_CMD          0x13
 
 /* Commands (to computer) */
+#define CMD_GET_SUPPORT_ANSWER  0x80
+#define CMD_TEST_DEVICE_ANSWER  0x81
 #define CMD_EM4100ID_ANSWER	    0x90
+#define CMD_T5557_BLOCK_WRITE_ANSWER    0x92
 #define CMD_EM4305_CMD_ANSWER	0x93
 
-static int verbose = 0;
-static int handle_events = 0;
+#define READ_RETRIES            10
+
+static volatile sig_atomic_t running = 1;
 
 /* timeout in ms */
 static int timeout=1000;        
-static uint8_t answer[48] = {0};
 
-void prepare_message(uint8_t *out_buf, int endpoint, int command, uint8_t *pl_buf, int pl_buf_size) {
-    int i,j;
-    int x = 0;
-    memset(out_buf, 0, 24);
-    out_buf[0] = endpoint;
-    out_buf[1] = MESSAGE_START_MARKER;
-    out_buf[2] = 5 + pl_buf_size;   //size of message
-    out_buf[3] = command;
-    i = 4;
-    if (pl_buf_size > 0) {
-        memcpy(&out_buf[i], pl_buf, pl_buf_size);
-        i+=pl_buf_size;
+/* Recent EM4100 answers of one reader for K of N voting (-K) */
+#define VOTE_MAX_N              16
+
+struct vote {
+    uint8_t id[VOTE_MAX_N][5];
+    uint8_t tag[VOTE_MAX_N];            /* 0: the sample was a NOTAG answer */
+    int pos;
+    uint64_t last_ns;                   /* answer_ns of the latest sample */
+};
+
+static int vote_k = 1;
+static int vote_n = 1;
+
+/* Adaptive polling (-A): the gap between EM4100 reads doubles from
+ * POLL_MIN_GAP_US after every POLL_IDLE_POLLS empty answers, up to the
+ * -A limit, and drops back to zero on any answer carrying id bytes */
+#define POLL_MIN_GAP_US         1000
+#define POLL_IDLE_POLLS         8
+#define POLL_MAX_LEVELS         16
+
+struct poll_level {
+    uint64_t time_ns;                   /* time spent at this level */
+    uint64_t busy_ns;                   /* time spent in read round trips */
+    uint64_t polls;
+    uint64_t detections;                /* empty -> tag transitions */
+    uint64_t latency_ns;                /* sum of detection latency bounds */
+    uint64_t latency_max_ns;
+};
+
+struct poll_rate {
+    int level;
+    int idle;                           /* empty answers at this level */
+    int empty;                          /* the latest answer had no id bytes */
+    uint64_t next_ns;                   /* next read is due */
+    uint64_t since_ns;                  /* last accounting update */
+    uint64_t last_ns;                   /* answer_ns of the latest answer */
+    struct poll_level lv[POLL_MAX_LEVELS];
+};
+
+static int poll_max_gap_ms = 0;         /* 0: poll back to back */
+static int poll_levels = 1;
+
+/* Round trip timeouts, estimated per reader and command class the way
+ * TCP does (RFC 6298). A round trip is one send_message_async: the OUT
+ * plus the answer pending from the previous command. Until a class has
+ * a sample the global timeout applies. */
+#define RTT_READ                0
+#define RTT_BUZZER              1
+#define RTT_T5577               2
+#define RTT_EM4305              3
+#define RTT_CLASSES             4
+#define RTO_MIN_US              20000
+#define RTO_GRANULARITY_US      1000
+
+struct rtt {
+    uint32_t srtt_us;                   /* 0: no sample yet */
+    uint32_t rttvar_us;
+    uint32_t rto_us;
+    uint32_t timeouts;
+};
+
+/* Idle time the reader needs after a command of each type before it
+ * takes the next one, see the timing profiles (-t, -c) */
+#define TIMING_READ             0
+#define TIMING_BLOCK_WRITE      1
+#define TIMING_WORD_WRITE       2
+#define TIMING_RESET            3
+#define TIMING_BUZZER           4
+#define TIMING_CLASSES          5
+
+struct timing {
+    uint32_t gap_us[TIMING_CLASSES];
+    int prev;                           /* type of the previous command */
+    uint64_t done_ns;                   /* its round trip ended */
+};
+
+/* Reader health, fed by every round trip. Long running modes probe the
+ * firmware at open (GetSupport, then TestDevice if that is understood)
+ * and send a TestDevice every HEALTH_PROBE_MS between polls; readers that
+ * do not support it get a read instead, and only when otherwise idle. */
+#define HEALTH_PROBE_MS         1000
+#define HEALTH_DEGRADED_MISSES  1
+#define HEALTH_DEAD_MISSES      3
+
+#define READER_OK               0
+#define READER_DEGRADED         1
+#define READER_DEAD             2
+
+#define CAP_GET_SUPPORT         0x01
+#define CAP_TEST_DEVICE         0x02
+
+struct health {
+    int state;
+    int misses;                         /* failed round trips in a row */
+    uint32_t caps;                      /* CAP_*, learned at open */
+    int probe_sent;                     /* CAP_* of the probe being sent */
+    uint8_t support[40];                /* GetSupport answer payload */
+    int support_len;
+    uint64_t next_probe_ns;             /* 0: not probed */
+};
+
+/* Fault recovery: a failed round trip is repaired by the cheapest step
+ * that fits what failed (see reader_recover) and the command sent again */
+#define RECOVER_CLEAR_HALT      0
+#define RECOVER_RESUBMIT        1
+#define RECOVER_RESET           2
+#define RECOVER_REOPEN          3
+#define RECOVER_STEPS           4
+#define RECOVER_RESENDS         2       /* per command */
+#define RECOVER_RESET_ERRORS    3       /* failed round trips in a row */
+#define RECOVER_REOPEN_MIN_MS   10
+#define RECOVER_REOPEN_MAX_MS   1000
+
+struct recover_step {
+    uint64_t attempts;
+    uint64_t ok;                        /* the command went through after it */
+    uint64_t time_ns;                   /* spent in the step itself */
+    uint64_t max_ns;
+};
+
+struct recovery {
+    int errors;                         /* failed round trips in a row */
+    int stall_ep;                       /* endpoint of the last STALL */
+    int last_step;                      /* -1: none for this command */
+    int resend;                         /* resends of this command so far */
+    char path[32];                      /* reopen by this USB path, "": never */
+    uint32_t reopen_ms;                 /* backoff between reopen scans */
+    uint64_t next_reopen_ns;
+    struct recover_step step[RECOVER_STEPS];
+};
+
+/* One claimed reader. The protocol functions only touch this state, so
+ * readers in different threads and libusb contexts do not interfere. */
+struct reader {
+    libusb_context *ctx;                /* NULL: default context */
+    struct libusb_device_handle *devh;
+    uint32_t id;
+    int handle_events;                  /* transfers still in flight */
+    int last_status;                    /* failed transfer status of the last command */
+    struct libusb_transfer *xfr_in;     /* IN transfer in flight, if any */
+    struct libusb_transfer *xfr_out;    /* OUT transfer in flight, if any */
+    uint64_t answer_ns;                 /* CLOCK_MONOTONIC completion time of answer */
+    uint64_t out_done_ns;               /* completion time of the last OUT */
+    uint64_t out_submit_ns;             /* submit times, for the trace spans */
+    uint64_t in_submit_ns;
+    int attempt;                        /* read_em4100id round trip, 0 otherwise */
+    /* optional hook run from interrupt_cb for every 48 byte answer, so
+       events leave in completion order */
+    void (*on_answer)(struct reader *rd);
+    void *user;
+    struct vote vote;
+    struct poll_rate poll;
+    struct rtt rtt[RTT_CLASSES];
+    struct timing timing;
+    struct cmd_queue *cmdq;             /* queued device requests, see cmdq_push */
+    struct health health;
+    uint64_t stale_reports;             /* dropped by drain_reports */
+    struct recovery recover;
+    /* The IN transfer left pending by send_message_async completes during
+     * the next command, so answers always land here, never in a local. */
+    uint8_t answer[48];
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Logging: log_warn(), log_info() and log_debug() write one line to stdout,
+ * "ts=<CLOCK_MONOTONIC s> level=<level> <message>", formatted into a
+ * buffer and written with a single fwrite. Levels above RFID_LOG_MAX are
+ * compiled out together with their arguments (make LOG_MAX=2 drops debug
+ * logging); at run time the level is warn, -v raises it to debug. Frames
+ * are logged with log_frame(), hex dumped in one pass.
+ */
+#define LOG_ERROR               0
+#define LOG_WARN                1
+#define LOG_INFO                2
+#define LOG_DEBUG               3
+#ifndef RFID_LOG_MAX
+#define RFID_LOG_MAX            LOG_DEBUG
+#endif
+#define LOG_LINE_MAX            512
+
+static int log_level = LOG_WARN;
+static const char *log_level_names[] = {"error", "warn", "info", "debug"};
+static const char *transfer_status_names[LIBUSB_TRANSFER_OVERFLOW + 1] = {
+    "completed", "error", "timed_out", "cancelled", "stall", "no_device", "overflow"};
+
+#define log_on(level)   ((level) <= RFID_LOG_MAX && (level) <= log_level)
+
+static int log_prefix(char *buf, int level) {
+    uint64_t ns = monotonic_ns();
+
+    return sprintf(buf, "ts=%llu.%06u level=%s ", (unsigned long long)ns / 1000000000,
+                   (unsigned)(ns % 1000000000 / 1000), log_level_names[level]);
+}
+
+static void log_line(char *buf, int n) {
+    if (n > LOG_LINE_MAX - 1)
+        n = LOG_LINE_MAX - 1;
+    buf[n++] = '\n';
+    fwrite(buf, 1, n, stdout);
+}
+
+static void __attribute__((format(printf, 2, 3))) log_write(int level, const char *fmt, ...) {
+    char buf[LOG_LINE_MAX];
+    int n = log_prefix(buf, level);
+    va_list ap;
+
+    va_start(ap, fmt);
+    n += vsnprintf(&buf[n], sizeof(buf) - n, fmt, ap);
+    va_end(ap);
+    log_line(buf, n);
+}
+
+/* reader=<id> ep=<in|out> event=<submit|transfer status> len=<n> data=<hex> */
+static void log_frame_write(int level, uint32_t reader, int in, const char *event,
+                            const uint8_t *data, int len) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[LOG_LINE_MAX];
+    int n = log_prefix(buf, level), i;
+
+    n += sprintf(&buf[n], "reader=%u ep=%s event=%s len=%d", reader, in ? "in" : "out", event, len);
+    if (len > 64)
+        len = 64;
+    if (len) {
+        memcpy(&buf[n], " data=", 6);
+        n += 6;
+    }
+    for (i=0 ; i<len ; i++) {
+        buf[n++] = hex[data[i] >> 4];
+        buf[n++] = hex[data[i] & 0x0f];
+    }
+    log_line(buf, n);
+}
+
+/* a level compiled out still type checks its arguments, but emits no code */
+#define log_at(level, ...)  do { if (log_on(level)) log_write(level, __VA_ARGS__); } while (0)
+#define log_none(...)       do { if (0) log_write(LOG_ERROR, __VA_ARGS__); } while (0)
+#if RFID_LOG_MAX >= LOG_WARN
+#define log_warn(...)       log_at(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...)       log_none(__VA_ARGS__)
+#endif
+#if RFID_LOG_MAX >= LOG_INFO
+#define log_info(...)       log_at(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...)       log_none(__VA_ARGS__)
+#endif
+#if RFID_LOG_MAX >= LOG_DEBUG
+#define log_debug(...)      log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_frame(...)      do { if (log_on(LOG_DEBUG)) log_frame_write(LOG_DEBUG, __VA_ARGS__); } while (0)
+#else
+#define log_debug(...)      log_none(__VA_ARGS__)
+#define log_frame(...)      do { if (0) log_frame_write(LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+/*
+ * Flight recorder: the last FLIGHT_SLOTS frames of all readers, recorded
+ * unconditionally (a slot claim and a 64 byte copy, the timestamp is the
+ * caller's) and written to flight_path by flight_dump, see rfid_flight.h.
+ */
+#define FLIGHT_SLOTS            4096    /* power of two */
+
+static struct rfid_flight_record flight[FLIGHT_SLOTS];
+static _Atomic uint64_t flight_head;
+static char flight_path[256];
+
+static inline void flight_record(uint32_t reader, int dir, int status,
+                                 const uint8_t *data, int len, uint64_t ns) {
+    uint64_t i = atomic_fetch_add_explicit(&flight_head, 1, memory_order_relaxed);
+    struct rfid_flight_record *f = &flight[i & (FLIGHT_SLOTS - 1)];
+
+    f->timestamp_ns = ns;
+    f->reader = reader;
+    f->dir = dir;
+    f->status = status;
+    f->len = len;
+    memcpy(f->data, data, len);
+}
+
+/* Only async signal safe calls, it runs from the signal handlers */
+static void flight_dump(int reason, int sig) {
+    struct rfid_flight_header h = {0};
+    uint64_t head = atomic_load_explicit(&flight_head, memory_order_relaxed);
+    uint32_t first;
+    struct timespec ts;
+    int fd;
+
+    if (!flight_path[0] || (fd = open(flight_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    h.magic = RFID_FLIGHT_MAGIC;
+    h.version = RFID_FLIGHT_VERSION;
+    h.record_size = sizeof(struct rfid_flight_record);
+    h.records = head < FLIGHT_SLOTS ? head : FLIGHT_SLOTS;
+    h.total = head;
+    h.dump_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    h.reason = reason;
+    h.signal = sig;
+    /* oldest first: from the slot head points at around to the one before */
+    first = head < FLIGHT_SLOTS ? 0 : head & (FLIGHT_SLOTS - 1);
+    if (write(fd, &h, sizeof(h)) == sizeof(h)
+            && write(fd, &flight[first], (h.records - first) * sizeof(flight[0])) >= 0)
+        write(fd, flight, first * sizeof(flight[0]));
+    close(fd);
+}
+
+static void flight_signal(int sig) {
+    flight_dump(RFID_FLIGHT_SIGNAL, sig);
+}
+
+static void flight_crash(int sig) {
+    flight_dump(RFID_FLIGHT_CRASH, sig);
+    /* SA_RESETHAND: die the way we would have without the handler */
+    raise(sig);
+}
+
+/* Print a dump written by flight_dump (-X) */
+int flight_print(const char *file) {
+    static const char *reasons[] = {"", "SIGUSR1", "crash", "reader dead"};
+    struct rfid_flight_header h;
+    struct rfid_flight_record f;
+    FILE *in;
+    uint32_t i;
+    int j;
+
+    if (!(in = fopen(file, "rb"))) {
+        fprintf(stderr, "could not open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    if (fread(&h, sizeof(h), 1, in) != 1 || h.magic != RFID_FLIGHT_MAGIC
+            || h.version != RFID_FLIGHT_VERSION || h.record_size != sizeof(f)) {
+        fprintf(stderr, "%s: not a flight recorder dump\n", file);
+        fclose(in);
+        return -1;
+    }
+    fprintf(stdout, "%u of %llu frames, dumped on %s", h.records, (unsigned long long)h.total,
+            h.reason < 4 ? reasons[h.reason] : "?");
+    if (h.reason == RFID_FLIGHT_CRASH)
+        fprintf(stdout, " (signal %u)", h.signal);
+    fprintf(stdout, "\n");
+    for (i=0 ; i<h.records && fread(&f, sizeof(f), 1, in) == 1 ; i++) {
+        if (!f.timestamp_ns)
+            continue;
+        fprintf(stdout, "%+12.3f ms  reader %-3u %-3s", ((double)f.timestamp_ns - h.dump_ns) / 1e6,
+                f.reader, f.dir == RFID_FLIGHT_OUT ? "OUT" : "IN");
+        if (f.status)
+            fprintf(stdout, " status %u", f.status);
+        for (j=0 ; j<f.len && j<(int)sizeof(f.data) ; j++)
+            fprintf(stdout, " %02x", f.data[j]);
+        fprintf(stdout, "\n");
+    }
+    fclose(in);
+    return 0;
+}
+
+/*
+ * Capture (-O): every transfer to and from the readers as a pcap file with
+ * the Linux usbmon link type, so Wireshark shows it like a usbmon trace.
+ * Frames are appended to one of two buffers under a lock; a writer thread
+ * writes a buffer out when it fills and once a second, so the polling
+ * threads never wait for the disk. If both buffers are full the frame is
+ * dropped and counted instead.
+ */
+#define CAP_BUF_SIZE            (256 * 1024)
+#define CAP_FLUSH_MS            1000
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+
+struct pcap_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;                   /* nanosecond pcap magic */
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+/* struct usbmon_packet, <linux/usb/mon.h> binary API */
+struct usbmon_hdr {
+    uint64_t id;                        /* URB, here the libusb transfer */
+    uint8_t type;                       /* 'S'ubmit, 'C'omplete, 'E'rror */
+    uint8_t xfer_type;                  /* 1: interrupt */
+    uint8_t epnum;
+    uint8_t devnum;
+    uint16_t busnum;
+    char flag_setup;
+    char flag_data;                     /* 0: data follows */
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;                     /* -errno */
+    uint32_t length;
+    uint32_t len_cap;
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;
+};
+
+struct capture {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uint8_t *buf[2];
+    size_t len;                         /* filling buf[cur] */
+    size_t out_len;                     /* buf[!cur] waiting for the writer */
+    int cur;
+    int stop;
+    uint64_t frames;
+    uint64_t dropped;
+    int64_t realtime_ns;                /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+};
+
+static struct capture *capture;
+
+static int32_t capture_status(int status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return 0;
+        case LIBUSB_TRANSFER_ERROR:     return -EPROTO;
+        case LIBUSB_TRANSFER_TIMED_OUT: return -ETIMEDOUT;
+        case LIBUSB_TRANSFER_CANCELLED: return -ENOENT;
+        case LIBUSB_TRANSFER_STALL:     return -EPIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE: return -ENODEV;
+        case LIBUSB_TRANSFER_OVERFLOW:  return -EOVERFLOW;
+        default:                        return -EIO;
+    }
+}
+
+/* Swap buffers for the writer, with the lock held; 0 if it is still busy */
+static int capture_swap(struct capture *c) {
+    if (c->out_len)
+        return 0;
+    c->out_len = c->len;
+    c->cur ^= 1;
+    c->len = 0;
+    pthread_cond_signal(&c->cond);
+    return 1;
+}
+
+/* One usbmon event: type 'S' or 'C', `len` bytes of `data` captured out
+ * of a `length` byte transfer */
+static void capture_frame(struct reader *rd, void *xfr, int type, int ep, int status,
+                          const uint8_t *data, int len, int length, uint64_t ns) {
+    struct capture *c = capture;
+    struct pcap_rec rec;
+    struct usbmon_hdr mon;
+    libusb_device *dev = libusb_get_device(rd->devh);
+    int64_t t = ns + c->realtime_ns;
+    size_t size = sizeof(rec) + sizeof(mon) + len;
+
+    memset(&mon, 0, sizeof(mon));
+    mon.id = (uintptr_t)xfr;
+    mon.type = status && type == 'C' ? 'E' : type;
+    mon.xfer_type = 1;
+    mon.epnum = ep;
+    mon.devnum = libusb_get_device_address(dev);
+    mon.busnum = libusb_get_bus_number(dev);
+    mon.flag_setup = '-';
+    mon.flag_data = len ? 0 : (ep & 0x80 ? '<' : '>');
+    mon.ts_sec = t / 1000000000;
+    mon.ts_usec = t % 1000000000 / 1000;
+    mon.status = capture_status(status);
+    mon.length = length;
+    mon.len_cap = len;
+    rec.ts_sec = t / 1000000000;
+    rec.ts_nsec = t % 1000000000;
+    rec.incl_len = rec.orig_len = sizeof(mon) + len;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->len + size > CAP_BUF_SIZE && !capture_swap(c)) {
+        c->dropped++;
+    } else {
+        memcpy(&c->buf[c->cur][c->len], &rec, sizeof(rec));
+        memcpy(&c->buf[c->cur][c->len + sizeof(rec)], &mon, sizeof(mon));
+        memcpy(&c->buf[c->cur][c->len + sizeof(rec) + sizeof(mon)], data, len);
+        c->len += size;
+        c->frames++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void *capture_thread_main(void *arg) {
+    struct capture *c = arg;
+    struct timespec ts;
+    size_t n;
+    int stop;
+
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CAP_FLUSH_MS / 1000;
+        while (!c->out_len && !c->stop
+               && pthread_cond_timedwait(&c->cond, &c->lock, &ts) != ETIMEDOUT)
+            ;
+        stop = c->stop;
+        /* once a second, or at the end, whatever has been captured */
+        if (!c->out_len && c->len)
+            capture_swap(c);
+        n = c->out_len;
+        pthread_mutex_unlock(&c->lock);
+        if (n && write(c->fd, c->buf[!c->cur], n) != (ssize_t)n)
+            log_warn("capture write failed: %s", strerror(errno));
+        pthread_mutex_lock(&c->lock);
+        c->out_len = 0;
+        if (stop && !c->len)
+            break;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+int capture_open(const char *path) {
+    struct pcap_hdr h = {0xa1b23c4d, 2, 4, 0, 0, 65535, LINKTYPE_USB_LINUX_MMAPPED};
+    struct timespec rt, mt;
+    struct capture *c;
+
+    c = calloc(1, sizeof(*c));
+    c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (c->fd < 0 || write(c->fd, &h, sizeof(h)) != sizeof(h)) {
+        fprintf(stderr, "could not write %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    c->buf[0] = malloc(CAP_BUF_SIZE);
+    c->buf[1] = malloc(CAP_BUF_SIZE);
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mt);
+    c->realtime_ns = (rt.tv_sec - mt.tv_sec) * 1000000000ll + (rt.tv_nsec - mt.tv_nsec);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    if (pthread_create(&c->thread, NULL, capture_thread_main, c) != 0) {
+        free(c->buf[0]);
+        free(c->buf[1]);
+        goto fail;
+    }
+    capture = c;
+    return 0;
+
+fail:
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c);
+    return -1;
+}
+
+void capture_close(void) {
+    struct capture *c = capture;
+
+    if (!c)
+        return;
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+    capture = NULL;
+    if (c->dropped)
+        log_warn("captured %llu frames, %llu dropped",
+                 (unsigned long long)c->frames, (unsigned long long)c->dropped);
+    else
+        log_info("captured %llu frames", (unsigned long long)c->frames);
+    close(c->fd);
+    free(c->buf[0]);
+    free(c->buf[1]);
+    free(c);
+}
+
+/*
+ * Trace (-J): every OUT and IN transfer as a Chrome trace event span, from
+ * submit to completion, one process track per reader and a thread track
+ * per polling thread, for Perfetto or chrome://tracing. Spans go to a
+ * binary double buffer like the capture; the writer thread turns a full
+ * buffer into JSON and writes it with one call.
+ */
+#define TRACE_BUF_SPANS         2048
+#define TRACE_FLUSH_MS          1000
+#define TRACE_JSON_SPAN         320     /* longest formatted span */
+#define TRACE_READERS           256     /* readers given a named track */
+
+struct trace_span {
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint32_t reader;
+    int32_t tid;
+    uint8_t in;
+    uint8_t cmd;
+    uint8_t size;                       /* IN: answer[2] */
+    uint8_t status;
+    uint16_t attempt;
+    uint16_t resend;
+};
+
+struct trace {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    struct trace_span *buf[2];
+    int len;                            /* filling buf[cur] */
+    int out_len;                        /* buf[!cur] waiting for the writer */
+    int cur;
+    int stop;
+    uint64_t spans;
+    uint64_t dropped;
+    uint64_t start_ns;
+    int events;                         /* written so far, for the commas */
+    char *json;
+    uint8_t named[TRACE_READERS];       /* process_name written */
+};
+
+static struct trace *trace;
+static __thread int32_t trace_tid;
+
+static int trace_swap(struct trace *t) {
+    if (t->out_len)
+        return 0;
+    t->out_len = t->len;
+    t->cur ^= 1;
+    t->len = 0;
+    pthread_cond_signal(&t->cond);
+    return 1;
+}
+
+static void trace_span(struct reader *rd, struct libusb_transfer *xfr, uint64_t start_ns, uint64_t end_ns) {
+    struct trace *t = trace;
+    struct trace_span sp;
+
+    if (!trace_tid)
+        trace_tid = syscall(SYS_gettid);
+    sp.start_ns = start_ns < end_ns ? start_ns : end_ns;
+    sp.end_ns = end_ns;
+    sp.reader = rd->id;
+    sp.tid = trace_tid;
+    sp.in = xfr->endpoint == ENDPOINT_IN;
+    sp.cmd = sp.in && xfr->actual_length < 4 ? 0 : xfr->buffer[3];
+    sp.size = sp.in && xfr->actual_length == 48 ? xfr->buffer[2] : 0;
+    sp.status = xfr->status;
+    sp.attempt = rd->attempt;
+    sp.resend = rd->recover.resend;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->len == TRACE_BUF_SPANS && !trace_swap(t)) {
+        t->dropped++;
+    } else {
+        t->buf[t->cur][t->len++] = sp;
+        t->spans++;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* Format `n` spans into t->json; returns its length */
+static size_t trace_format(struct trace *t, const struct trace_span *sp, int n) {
+    size_t len = 0;
+    uint64_t ts;
+    int i;
+
+    for (i=0 ; i<n ; i++, sp++) {
+        if (sp->reader < TRACE_READERS && !t->named[sp->reader]) {
+            t->named[sp->reader] = 1;
+            len += sprintf(&t->json[len], "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                           "\"args\":{\"name\":\"reader %u\"}}", t->events++ ? ",\n" : "",
+                           sp->reader, sp->reader);
+        }
+        ts = sp->start_ns - t->start_ns;
+        len += sprintf(&t->json[len], "%s{\"name\":\"%s %02x\",\"cat\":\"usb\",\"ph\":\"X\","
+                       "\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%u,\"tid\":%d,"
+                       "\"args\":{\"cmd\":\"0x%02x\",", t->events++ ? ",\n" : "",
+                       sp->in ? "IN" : "OUT", sp->cmd, (unsigned long long)ts / 1000, (unsigned)(ts % 1000),
+                       (unsigned long long)(sp->end_ns - sp->start_ns) / 1000,
+                       (unsigned)((sp->end_ns - sp->start_ns) % 1000), sp->reader, sp->tid, sp->cmd);
+        if (sp->in)
+            len += sprintf(&t->json[len], "\"size\":%u,", sp->size);
+        len += sprintf(&t->json[len], "\"retry\":%u,\"resend\":%u,\"status\":\"%s\"}}",
+                       sp->attempt, sp->resend,
+                       sp->status <= LIBUSB_TRANSFER_OVERFLOW ? transfer_status_names[sp->status] : "unknown");
+    }
+    return len;
+}
+
+static void *trace_thread_main(void *arg) {
+    struct trace *t = arg;
+    struct timespec ts;
+    size_t len;
+    int n, stop;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += TRACE_FLUSH_MS / 1000;
+        while (!t->out_len && !t->stop
+               && pthread_cond_timedwait(&t->cond, &t->lock, &ts) != ETIMEDOUT)
+            ;
+        stop = t->stop;
+        if (!t->out_len && t->len)
+            trace_swap(t);
+        n = t->out_len;
+        pthread_mutex_unlock(&t->lock);
+        len = trace_format(t, t->buf[!t->cur], n);
+        if (len && write(t->fd, t->json, len) != (ssize_t)len)
+            log_warn("trace write failed: %s", strerror(errno));
+        pthread_mutex_lock(&t->lock);
+        t->out_len = 0;
+        if (stop && !t->len)
+            break;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+int trace_open(const char *path) {
+    static const char head[] = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    struct trace *t;
+
+    t = calloc(1, sizeof(*t));
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->fd < 0 || write(t->fd, head, sizeof(head) - 1) != sizeof(head) - 1) {
+        fprintf(stderr, "could not write %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    t->buf[0] = malloc(TRACE_BUF_SPANS * sizeof(struct trace_span));
+    t->buf[1] = malloc(TRACE_BUF_SPANS * sizeof(struct trace_span));
+    /* every span may also name its reader */
+    t->json = malloc(TRACE_BUF_SPANS * 2 * TRACE_JSON_SPAN);
+    t->start_ns = monotonic_ns();
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (pthread_create(&t->thread, NULL, trace_thread_main, t) != 0)
+        goto fail_free;
+    trace = t;
+    return 0;
+
+fail_free:
+    free(t->buf[0]);
+    free(t->buf[1]);
+    free(t->json);
+fail:
+    if (t->fd >= 0)
+        close(t->fd);
+    free(t);
+    return -1;
+}
+
+void trace_close(void) {
+    static const char tail[] = "\n]}\n";
+    struct trace *t = trace;
+
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->stop = 1;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    trace = NULL;
+    if (write(t->fd, tail, sizeof(tail) - 1) != sizeof(tail) - 1)
+        log_warn("trace write failed: %s", strerror(errno));
+    if (t->dropped)
+        log_warn("traced %llu transfers, %llu dropped",
+                 (unsigned long long)t->spans, (unsigned long long)t->dropped);
+    else
+        log_info("traced %llu transfers", (unsigned long long)t->spans);
+    close(t->fd);
+    free(t->buf[0]);
+    free(t->buf[1]);
+    free(t->json);
+    free(t);
+}
+
+/*
+ * Latency histograms: every command is timed per stage (frame build, OUT
+ * submit to completion, OUT completion to answer, decode, output) into
+ * log-linear HDR histograms per command class, LAT_SUB buckets per power
+ * of two, so any percentile is within 1/LAT_SUB of the true value. Each
+ * thread records into its own set without atomic read-modify-writes; the
+ * sets are linked into lat_sets on first use and outlive their threads,
+ * reports sum them. SIGUSR2 prints a report from the long running modes,
+ * which also print one at exit.
+ */
+#define LAT_READ                0
+#define LAT_PROBE               1
+#define LAT_BUZZER              2
+#define LAT_T5577               3
+#define LAT_EM4305              4
+#define LAT_CLASSES             5
+
+#define LAT_BUILD               0
+#define LAT_OUT                 1
+#define LAT_IN                  2
+#define LAT_DECODE              3
+#define LAT_OUTPUT              4
+#define LAT_STAGES              5
+
+#define LAT_SUB_BITS            5
+#define LAT_SUB                 (1 << LAT_SUB_BITS)
+#define LAT_SHIFTS              32      /* up to 2^(LAT_SHIFTS + LAT_SUB_BITS + 1) ns, 275 s */
+#define LAT_BUCKETS             ((LAT_SHIFTS + 2) * LAT_SUB)
+
+struct lat_hist {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t bucket[LAT_BUCKETS];
+};
+
+struct lat_set {
+    struct lat_set *next;
+    struct lat_hist h[LAT_CLASSES][LAT_STAGES];
+};
+
+static const char *lat_class_names[LAT_CLASSES] = {"read", "probe", "buzzer", "t5577", "em4305"};
+static const char *lat_stage_names[LAT_STAGES] = {"build", "out", "in", "decode", "output"};
+static _Atomic(struct lat_set *) lat_sets;
+static __thread struct lat_set *lat_mine;
+static volatile sig_atomic_t lat_report_requested = 0;
+
+static int lat_class(uint8_t cmd) {
+    switch (cmd) {
+        case CMD_GET_SUPPORT:
+        case CMD_TEST_DEVICE:
+            return LAT_PROBE;
+        case CMD_BUZZER:
+            return LAT_BUZZER;
+        case CMD_T5557_BLOCK_WRITE:
+            return LAT_T5577;
+        case CMD_EM4305_CMD:
+            return LAT_EM4305;
+        default:
+            return LAT_READ;
+    }
+}
+
+/* Values below 2 * LAT_SUB are exact, above the top LAT_SUB_BITS + 1
+ * bits count */
+static int lat_bucket(uint64_t v) {
+    int shift;
+
+    if (v < 2 * LAT_SUB)
+        return v;
+    shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+    if (shift > LAT_SHIFTS)
+        return LAT_BUCKETS - 1;
+    return shift * LAT_SUB + (v >> shift);
+}
+
+/* Highest value that lands in bucket `b` */
+static uint64_t lat_bucket_max(int b) {
+    int shift = b / LAT_SUB - 1;
+
+    if (b < 2 * LAT_SUB)
+        return b;
+    return ((uint64_t)(b % LAT_SUB + LAT_SUB + 1) << shift) - 1;
+}
+
+static struct lat_set *lat_attach(void) {
+    struct lat_set *s = calloc(1, sizeof(*s));
+
+    if (!s)
+        return NULL;
+    s->next = atomic_load(&lat_sets);
+    while (!atomic_compare_exchange_weak(&lat_sets, &s->next, s))
+        ;
+    lat_mine = s;
+    return s;
+}
+
+/* Only the owning thread writes a set, loads and stores are enough */
+static void counter_add(_Atomic uint64_t *c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static void lat_record(int cls, int stage, uint64_t ns) {
+    struct lat_set *s = lat_mine ? lat_mine : lat_attach();
+    struct lat_hist *h;
+
+    if (!s)
+        return;
+    h = &s->h[cls][stage];
+    counter_add(&h->bucket[lat_bucket(ns)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum_ns, ns);
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+}
+
+/* Value at quantile q of the summed buckets */
+static uint64_t lat_quantile(const uint64_t *bucket, uint64_t count, uint64_t max_ns, double q) {
+    uint64_t rank = (uint64_t)(q * count), seen = 0;
+    int b;
+
+    for (b=0 ; b<LAT_BUCKETS ; b++) {
+        seen += bucket[b];
+        if (seen > rank)
+            return lat_bucket_max(b) < max_ns ? lat_bucket_max(b) : max_ns;
+    }
+    return max_ns;
+}
+
+/* Sum one class and stage over all threads */
+static uint64_t lat_sum(int c, int st, uint64_t *bucket, uint64_t *sum, uint64_t *max) {
+    struct lat_set *s;
+    struct lat_hist *h;
+    uint64_t count = 0, v;
+    int b;
+
+    memset(bucket, 0, LAT_BUCKETS * sizeof(*bucket));
+    *sum = *max = 0;
+    for (s = atomic_load(&lat_sets) ; s ; s = s->next) {
+        h = &s->h[c][st];
+        count += atomic_load_explicit(&h->count, memory_order_relaxed);
+        *sum += atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+        v = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+        if (v > *max)
+            *max = v;
+        for (b=0 ; b<LAT_BUCKETS ; b++)
+            bucket[b] += atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+    }
+    return count;
+}
+
+static void lat_report(void) {
+    static uint64_t bucket[LAT_BUCKETS];
+    uint64_t count, sum, max;
+    int c, st, header = 0;
+
+    for (c=0 ; c<LAT_CLASSES ; c++) {
+        for (st=0 ; st<LAT_STAGES ; st++) {
+            if (!(count = lat_sum(c, st, bucket, &sum, &max)))
+                continue;
+            if (!header++)
+                fprintf(stderr, "%-7s %-7s %10s %10s %10s %10s %10s %10s %10s\n", "latency", "stage",
+                        "count", "avg us", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+            fprintf(stderr, "%-7s %-7s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                    lat_class_names[c], lat_stage_names[st], (unsigned long long)count,
+                    sum / 1e3 / count, lat_quantile(bucket, count, max, 0.5) / 1e3,
+                    lat_quantile(bucket, count, max, 0.9) / 1e3,
+                    lat_quantile(bucket, count, max, 0.99) / 1e3,
+                    lat_quantile(bucket, count, max, 0.999) / 1e3, max / 1e3);
+        }
+    }
+}
+
+static void lat_signal(int sig) {
+    (void)sig;
+    lat_report_requested = 1;
+}
+
+/*
+ * Per reader counters for the metrics export (-M, see metrics_write).
+ * Like the latency histograms they live in per thread sets, indexed by
+ * reader id, so the polling threads never share a cache line with each
+ * other or with the export. Gauges have a single writer, the thread that
+ * owns the reader at the time.
+ */
+#define METRICS_READERS         256
+#define METRICS_STATUSES        (LIBUSB_TRANSFER_OVERFLOW + 1)
+
+struct reader_counters {
+    _Atomic uint64_t reads;                 /* read_em4100id found a tag */
+    _Atomic uint64_t notags;                /* it gave up without one */
+    _Atomic uint64_t retries;               /* round trips past the first */
+    _Atomic uint64_t transfers[2][METRICS_STATUSES];    /* [OUT, IN][status] */
+};
+
+struct metrics_set {
+    struct metrics_set *next;
+    struct reader_counters r[METRICS_READERS];
+};
+
+struct reader_gauges {
+    _Atomic int state;                      /* 0: closed, else READER_* + 1 */
+    _Atomic int queued;                     /* device requests in its cmd_queue */
+};
+
+static _Atomic(struct metrics_set *) metrics_sets;
+static __thread struct metrics_set *metrics_mine;
+static struct reader_gauges metrics_gauges[METRICS_READERS];
+
+static struct reader_counters *metrics_reader(uint32_t id) {
+    struct metrics_set *s = metrics_mine;
+
+    if (id >= METRICS_READERS)
+        return NULL;
+    if (!s) {
+        if (!(s = calloc(1, sizeof(*s))))
+            return NULL;
+        s->next = atomic_load(&metrics_sets);
+        while (!atomic_compare_exchange_weak(&metrics_sets, &s->next, s))
+            ;
+        metrics_mine = s;
+    }
+    return &s->r[id];
+}
+
+static void metrics_gauge(_Atomic int *g, int v) {
+    atomic_store_explicit(g, v, memory_order_relaxed);
+}
+
+
+void prepare_message(uint8_t *out_buf, int endpoint, int command, uint8_t *pl_buf, int pl_buf_size) {
+    int i,j;
+    int x = 0;
+    uint64_t start_ns = monotonic_ns();
+    memset(out_buf, 0, 24);
+    out_buf[0] = endpoint;
+    out_buf[1] = MESSAGE_START_MARKER;
+    out_buf[2] = 5 + pl_buf_size;   //size of message
+    out_buf[3] = command;
+    i = 4;
+    if (pl_buf_size > 0) {
+        memcpy(&out_buf[i], pl_buf, pl_buf_size);
+        i+=pl_buf_size;
+    }
+    /* Calculate checksum byte */
+    for (j=1 ; j<i ; j++) {
+        x = x^out_buf[j];
+    }
+    out_buf[i] = x;
+    out_buf[i+1] = MESSAGE_END_MARKER;
+    lat_record(lat_class(command), LAT_BUILD, monotonic_ns() - start_ns);
+}
+
+void send_message(struct libusb_device_handle * devh, uint8_t *message, uint8_t *answer) {
+    int r;
+    int bt = 0;
+
+    r = libusb_interrupt_transfer(devh, ENDPOINT_IN, answer, 48, &bt, timeout);
+    log_frame(0, 1, r < 0 ? libusb_error_name(r) : "completed", answer, bt);
+    r = libusb_interrupt_transfer(devh, ENDPOINT_OUT, message, 24, &bt, timeout);
+    log_frame(0, 0, r < 0 ? libusb_error_name(r) : "completed", message, 24);
+}
+
+/* Answers carry the XOR of everything from the start marker up to the
+ * checksum byte, the same as our OUT frames */
+static int answer_checksum_ok(const uint8_t *answer) {
+    int msg_size = answer[2], i;
+    uint8_t x = 0;
+
+    if (msg_size < 3 || msg_size > 47)
+        return 0;
+    for (i=1 ; i<msg_size-1 ; i++)
+        x ^= answer[i];
+    return x == answer[msg_size-1];
+}
+
+void handle_interrupt_answer(uint8_t *int_buf, int int_buf_size) {
+    int msg_size = 0;
+    uint8_t cmd = 0;
+
+    if (int_buf_size == 48) {
+        /* parse buffer */
+        if (int_buf[0] != 0x05)
+            log_warn("invalid endpoint value %02x!=5", int_buf[0]);
+
+        if (int_buf[1] != MESSAGE_START_MARKER)
+            log_warn("invalid start marker %02x!=0x01", int_buf[1]);
+
+        msg_size = int_buf[2];
+        if (msg_size > (48-1)) {
+            /* the end marker would lie past the report */
+            log_warn("invalid msg size %d", msg_size);
+            return;
+        }
+
+        cmd = int_buf[3];
+
+        if (!answer_checksum_ok(int_buf))
+            log_warn("checksum missmatch %02x", int_buf[msg_size-1]);
+
+        if (int_buf[msg_size] != MESSAGE_END_MARKER)
+            log_warn("invalid end marker !=0x04");
+
+        switch (cmd) {
+            case CMD_EM4100ID_ANSWER:
+                if (msg_size != 0x06)
+                    log_debug("em4100 id %02x%02x%02x%02x%02x", int_buf[5], int_buf[6], int_buf[7],
+                              int_buf[8], int_buf[9]);
+                break;
+            default:
+                break;
+        }
+    }    
+}
+
+void interrupt_cb(struct libusb_transfer *xfr){
+    struct reader *rd = xfr->user_data;
+    struct reader_counters *rc;
+    uint64_t now;
+
+    if (xfr == rd->xfr_in)
+        rd->xfr_in = NULL;
+    if (xfr == rd->xfr_out)
+        rd->xfr_out = NULL;
+
+    now = monotonic_ns();
+    if (xfr->endpoint == ENDPOINT_IN)
+        flight_record(rd->id, RFID_FLIGHT_IN, xfr->status, xfr->buffer,
+                      xfr->actual_length < 48 ? xfr->actual_length : 48, now);
+    else if (xfr->status != LIBUSB_TRANSFER_COMPLETED)
+        flight_record(rd->id, RFID_FLIGHT_OUT, xfr->status, xfr->buffer, 0, now);
+    if (capture)
+        capture_frame(rd, xfr, 'C', xfr->endpoint, xfr->status, xfr->buffer,
+                      xfr->endpoint == ENDPOINT_IN ? xfr->actual_length : 0, xfr->actual_length, now);
+    if (trace)
+        trace_span(rd, xfr, xfr->endpoint == ENDPOINT_IN ? rd->in_submit_ns : rd->out_submit_ns, now);
+    if ((rc = metrics_reader(rd->id)) && xfr->status < METRICS_STATUSES)
+        counter_add(&rc->transfers[xfr->endpoint == ENDPOINT_IN][xfr->status], 1);
+
+    log_frame(rd->id, xfr->endpoint == ENDPOINT_IN,
+              xfr->status <= LIBUSB_TRANSFER_OVERFLOW ? transfer_status_names[xfr->status] : "unknown",
+              xfr->buffer, xfr->endpoint == ENDPOINT_IN ? xfr->actual_length : 0);
+
+    switch(xfr->status)    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            rd->handle_events-=1;
+            if (xfr->endpoint == ENDPOINT_IN && xfr->actual_length == 48) {
+                handle_interrupt_answer(xfr->buffer, xfr->actual_length);
+                memcpy(rd->answer, xfr->buffer, 48);   //only handle 48 byte answers
+                rd->answer_ns = monotonic_ns();
+                if (rd->on_answer)
+                    rd->on_answer(rd);
+            } else if (xfr->endpoint == ENDPOINT_OUT) {
+                rd->out_done_ns = now;
+            } else {
+                /* a short answer is no answer, and the previous one must
+                   not be decoded in its place */
+                memset(rd->answer, 0, sizeof(rd->answer));
+                rd->last_status = LIBUSB_TRANSFER_ERROR;
+            }
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+        case LIBUSB_TRANSFER_NO_DEVICE:
+        case LIBUSB_TRANSFER_TIMED_OUT:
+        case LIBUSB_TRANSFER_ERROR:
+        case LIBUSB_TRANSFER_STALL:
+        case LIBUSB_TRANSFER_OVERFLOW:
+            if (xfr->status == LIBUSB_TRANSFER_STALL)
+                rd->recover.stall_ep = xfr->endpoint;
+            rd->last_status = xfr->status;
+            rd->handle_events = 0;
+            break;
+    }
+}
+
+/* Leave the IN transfer pending that the next command's answer lands in */
+static int arm_in(struct reader *rd) {
+    struct libusb_transfer *xfr_in;
+    uint8_t* usb_msg_in = calloc(1, 48);
+    int r;
+
+    xfr_in = libusb_alloc_transfer(0);
+    /* the IN stays pending until the next command, however long the
+       caller idles, so it has no timeout of its own: the round trip
+       deadline in send_message_async covers it */
+    libusb_fill_interrupt_transfer(xfr_in, rd->devh, ENDPOINT_IN, usb_msg_in, 48, interrupt_cb, rd, 0);
+    xfr_in->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+    rd->in_submit_ns = monotonic_ns();
+    if (capture)
+        capture_frame(rd, xfr_in, 'S', ENDPOINT_IN, 0, NULL, 0, 48, rd->in_submit_ns);
+    if((r = libusb_submit_transfer(xfr_in)) < 0) {
+        libusb_free_transfer(xfr_in);
+        return r;
+    }
+    rd->handle_events = 1;
+    rd->xfr_in = xfr_in;
+    return 0;
+}
+
+/* Stale reports: answers nobody collected, from a previous run that died
+ * mid command or from a round trip that timed out before its answer
+ * came. Read and drop them until the IN endpoint stays quiet for
+ * DRAIN_QUIET_MS (at most DRAIN_MAX_FRAMES), then re-arm the IN.
+ * Returns the number of frames dropped or a libusb error. */
+#define DRAIN_QUIET_MS          20
+#define DRAIN_MAX_FRAMES        16
+
+/* Take back the pending IN; the cancel is ours, so the status of the
+ * failed command is kept */
+static void cancel_in(struct reader *rd) {
+    int status = rd->last_status;
+
+    if (rd->xfr_in && libusb_cancel_transfer(rd->xfr_in) == LIBUSB_SUCCESS) {
+        while (rd->xfr_in) {
+            if (libusb_handle_events(rd->ctx) != LIBUSB_SUCCESS) break;
+        }
+    }
+    rd->last_status = status;
+    rd->handle_events = 0;
+}
+
+int drain_reports(struct reader *rd) {
+    uint8_t buf[48];
+    int n = 0, bt, r = 0;
+
+    cancel_in(rd);
+
+    while (n < DRAIN_MAX_FRAMES) {
+        bt = 0;
+        r = libusb_interrupt_transfer(rd->devh, ENDPOINT_IN, buf, sizeof(buf), &bt, DRAIN_QUIET_MS);
+        if (r == LIBUSB_ERROR_TIMEOUT && !bt) {
+            r = 0;
+            break;
+        }
+        if (r < 0 && r != LIBUSB_ERROR_TIMEOUT)
+            break;
+        n++;
+        log_debug("reader %u: dropped stale report %02x, %d bytes",
+                  rd->id, bt > 3 ? buf[3] : 0, bt);
+    }
+    rd->stale_reports += n;
+    if (n == DRAIN_MAX_FRAMES)
+        log_warn("reader %u: IN endpoint not quiet after %d reports", rd->id, n);
+    else if (r < 0)
+        log_warn("reader %u: drain failed: %s", rd->id, libusb_error_name(r));
+    if (n)
+        log_debug("reader %u: %d stale reports dropped", rd->id, n);
+
+    if (arm_in(rd) < 0 && !r)
+        r = LIBUSB_ERROR_IO;
+    return r < 0 ? r : n;
+}
+
+/* The protocol needs an IN request pending before every command, and
+ * whatever the reader still holds from before must not be taken for
+ * the first answer. Opening does not wait DRAIN_QUIET_MS for that: the
+ * IN is armed and checked once without blocking, and only a report
+ * already waiting sends the reader through the full drain. Recovery
+ * drains unconditionally. */
+void init_protocol(struct reader *rd) {
+    void (*on_answer)(struct reader *rd) = rd->on_answer;
+    struct timeval tv = {0, 0};
+    int n = 0;
+
+    rd->on_answer = NULL;
+    if (arm_in(rd) < 0 || (libusb_handle_events_timeout_completed(rd->ctx, &tv, NULL) == LIBUSB_SUCCESS
+                           && !rd->xfr_in))
+        n = drain_reports(rd);
+    rd->on_answer = on_answer;
+    rd->last_status = 0;
+    memset(rd->answer, 0, sizeof(rd->answer));
+
+    if (n >= 0)
+        log_debug("init succeeded, %d stale reports", n);
+}
+
+void uninit_protocol(struct reader *rd) {
+    log_debug("uninit_protocol");
+    while(rd->handle_events) {
+        if(libusb_handle_events(rd->ctx) != LIBUSB_SUCCESS) break;
+        log_debug("loop uninit");
+    }
+}
+
+static struct rtt *rtt_class(struct reader *rd, uint8_t cmd) {
+    switch (cmd) {
+        case CMD_BUZZER:
+            return &rd->rtt[RTT_BUZZER];
+        case CMD_T5557_BLOCK_WRITE:
+            return &rd->rtt[RTT_T5577];
+        case CMD_EM4305_CMD:
+            return &rd->rtt[RTT_EM4305];
+        default:
+            return &rd->rtt[RTT_READ];
+    }
+}
+
+static uint32_t rtt_timeout_us(struct rtt *t) {
+    return t->rto_us ? t->rto_us : (uint32_t)timeout * 1000;
+}
+
+static void rtt_sample(struct rtt *t, uint32_t r) {
+    uint32_t delta;
+
+    if (!t->srtt_us) {
+        t->srtt_us = r;
+        t->rttvar_us = r / 2;
+    } else {
+        delta = t->srtt_us > r ? t->srtt_us - r : r - t->srtt_us;
+        t->rttvar_us = (3 * t->rttvar_us + delta) / 4;
+        t->srtt_us = (7 * t->srtt_us + r) / 8;
+    }
+    t->rto_us = t->srtt_us + (4 * t->rttvar_us > RTO_GRANULARITY_US ? 4 * t->rttvar_us : RTO_GRANULARITY_US);
+    if (t->rto_us < RTO_MIN_US)
+        t->rto_us = RTO_MIN_US;
+    if (t->rto_us > (uint32_t)timeout * 1000)
+        t->rto_us = (uint32_t)timeout * 1000;
+}
+
+/* The round trip did not finish in time: give up on the transfers still
+ * in flight and back the timeout off until the next good sample */
+static void rtt_expired(struct reader *rd, struct rtt *t, uint8_t cmd) {
+    if (rd->xfr_in)
+        libusb_cancel_transfer(rd->xfr_in);
+    if (rd->xfr_out)
+        libusb_cancel_transfer(rd->xfr_out);
+    while (rd->xfr_in || rd->xfr_out) {
+        if (libusb_handle_events(rd->ctx) != LIBUSB_SUCCESS) break;
+    }
+    t->timeouts++;
+    t->rto_us = rtt_timeout_us(t) * 2;
+    if (t->rto_us > (uint32_t)timeout * 1000)
+        t->rto_us = (uint32_t)timeout * 1000;
+    rd->handle_events = 0;
+    rd->last_status = LIBUSB_TRANSFER_TIMED_OUT;
+    /* the answer never came, do not let callers decode the previous one */
+    memset(rd->answer, 0, sizeof(rd->answer));
+    log_debug("reader %u: command %02x timed out, rto %u us",
+              rd->id, cmd, t->rto_us);
+}
+
+static const char *health_names[] = {"ok", "degraded", "dead"};
+static int health_watch = 0;            /* long running modes: report changes, dump a dead reader */
+
+/* Account one round trip, judging a probe by its answer */
+static void health_round(struct reader *rd) {
+    struct health *h = &rd->health;
+    int probe = h->probe_sent;
+    int ok = !rd->last_status;
+    int state, len;
+
+    h->probe_sent = 0;
+    if (ok && probe == CAP_GET_SUPPORT && rd->answer[3] == CMD_GET_SUPPORT_ANSWER) {
+        h->caps |= CAP_GET_SUPPORT;
+        len = rd->answer[2] - MESSAGE_STRUCTURE_SIZE - 1;
+        if (len < 0)
+            len = 0;
+        if (len > (int)sizeof(h->support))
+            len = sizeof(h->support);
+        memcpy(h->support, &rd->answer[5], len);
+        h->support_len = len;
+    }
+    if (ok && probe == CAP_TEST_DEVICE) {
+        if (rd->answer[3] == CMD_TEST_DEVICE_ANSWER)
+            h->caps |= CAP_TEST_DEVICE;
+        else if (h->caps & CAP_TEST_DEVICE)
+            ok = 0;             /* answered, but not to its self test */
+    }
+    /* without TestDevice any answer proves the reader alive */
+    if (ok && h->next_probe_ns && !(h->caps & CAP_TEST_DEVICE))
+        h->next_probe_ns = rd->timing.done_ns + HEALTH_PROBE_MS * 1000000ull;
+
+    h->misses = ok ? 0 : h->misses + 1;
+    state = h->misses >= HEALTH_DEAD_MISSES ? READER_DEAD
+          : h->misses >= HEALTH_DEGRADED_MISSES ? READER_DEGRADED : READER_OK;
+    if (state != h->state && !health_watch)
+        log_debug("reader %u: %s", rd->id, health_names[state]);
+    else if (state != h->state && state == READER_OK)
+        log_info("reader %u: %s", rd->id, health_names[state]);
+    else if (state != h->state)
+        log_warn("reader %u: %s", rd->id, health_names[state]);
+    if (health_watch && state == READER_DEAD && h->state != READER_DEAD)
+        flight_dump(RFID_FLIGHT_DEAD, 0);
+    h->state = state;
+    if (rd->id < METRICS_READERS)
+        metrics_gauge(&metrics_gauges[rd->id].state, state + 1);
+}
+
+/* Whether the firmware listed `command` in its GetSupport answer; readers
+ * that were not probed or do not answer GetSupport are given the benefit
+ * of the doubt */
+static int reader_supports(struct reader *rd, uint8_t command) {
+    struct health *h = &rd->health;
+    int i;
+
+    if (!(h->caps & CAP_GET_SUPPORT))
+        return 1;
+    for (i=0 ; i<h->support_len ; i++)
+        if (h->support[i] == command)
+            return 1;
+    log_debug("reader %u: command %02x not supported", rd->id, command);
+    return 0;
+}
+
+static int timing_class(const uint8_t *message) {
+    switch (message[3]) {
+        case CMD_BUZZER:
+            return TIMING_BUZZER;
+        case CMD_T5557_BLOCK_WRITE:
+            /* t55xx_reset sends the bare 5 byte payload */
+            return message[2] == MESSAGE_STRUCTURE_SIZE + 5 ? TIMING_RESET : TIMING_BLOCK_WRITE;
+        case CMD_EM4305_CMD:
+            return TIMING_WORD_WRITE;
+        default:
+            return TIMING_READ;
+    }
+}
+
+/* Hold the next command back until the previous one's gap has passed */
+static void timing_wait(struct reader *rd) {
+    uint64_t due = rd->timing.done_ns + rd->timing.gap_us[rd->timing.prev] * 1000ull;
+    uint64_t now = monotonic_ns();
+    struct timespec ts;
+
+    if (now >= due)
+        return;
+    ts.tv_sec = (due - now) / 1000000000;
+    ts.tv_nsec = (due - now) % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+int reader_recover(struct reader *rd, int tries);
+
+/* One round trip: the OUT, and the answer to it on the IN left pending
+ * by the previous command */
+static void round_trip(struct reader *rd, uint8_t *message) {
+    struct libusb_transfer *xfr_out;
+    uint8_t* usb_msg_out = malloc(24);
+    struct rtt *rtt = rtt_class(rd, message[3]);
+    uint64_t start_ns, deadline_ns, now;
+    struct timeval tv;
+    int r;
+
+    xfr_out = libusb_alloc_transfer(0);
+
+    memcpy(usb_msg_out, message, 24);
+    libusb_fill_interrupt_transfer(xfr_out, rd->devh, ENDPOINT_OUT, usb_msg_out, 24, interrupt_cb, rd,
+                                   (rtt_timeout_us(rtt) + 999) / 1000);
+    /* let libusb release it once its callback ran, long running modes
+       go through here for every poll */
+    xfr_out->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+    /* wait for the OUT and the IN left pending by the previous command;
+       other readers sharing the context are serviced by the same loop */
+    rd->last_status = 0;
+    timing_wait(rd);
+    start_ns = monotonic_ns();
+    deadline_ns = start_ns + (uint64_t)rtt_timeout_us(rtt) * 1000;
+    rd->out_submit_ns = start_ns;
+    log_frame(rd->id, 0, "submit", message, 24);
+    flight_record(rd->id, RFID_FLIGHT_OUT, 0, message, 24, start_ns);
+    if (capture)
+        capture_frame(rd, xfr_out, 'S', ENDPOINT_OUT, 0, message, 24, 24, start_ns);
+    if((r = libusb_submit_transfer(xfr_out)) < 0) {
+        libusb_free_transfer(xfr_out);
+        /* nothing will answer, do not wait for the deadline */
+        rd->last_status = r == LIBUSB_ERROR_NO_DEVICE ? LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+    } else {
+        rd->handle_events += 1;
+        rd->xfr_out = xfr_out;
+    }
+
+    while(rd->handle_events > 0 && !rd->last_status) {
+        now = monotonic_ns();
+        if (now >= deadline_ns) {
+            rtt_expired(rd, rtt, message[3]);
+            break;
+        }
+        tv.tv_sec = (deadline_ns - now) / 1000000000;
+        tv.tv_usec = (deadline_ns - now) % 1000000000 / 1000;
+        if(libusb_handle_events_timeout_completed(rd->ctx, &tv, NULL) != LIBUSB_SUCCESS) break;
+        log_debug("event %d handled", rd->handle_events);
+    }
+    rd->timing.prev = timing_class(message);
+    rd->timing.done_ns = monotonic_ns();
+    if (rd->handle_events == 0 && !rd->last_status) {
+        rtt_sample(rtt, (rd->timing.done_ns - start_ns) / 1000);
+        lat_record(lat_class(message[3]), LAT_OUT, rd->out_done_ns - start_ns);
+        /* the answer can be reaped before the OUT's completion */
+        lat_record(lat_class(message[3]), LAT_IN,
+                   rd->answer_ns > rd->out_done_ns ? rd->answer_ns - rd->out_done_ns : 0);
+    }
+}
+
+void send_message_async(struct reader *rd, uint8_t *message) {
+    struct recovery *rc = &rd->recover;
+    int tries = 0;
+
+    rc->last_step = -1;
+    rc->resend = 0;
+    round_trip(rd, message);
+    while (rd->last_status && reader_recover(rd, tries++)) {
+        rc->resend = tries;
+        round_trip(rd, message);
+    }
+    health_round(rd);
+
+    if (!rd->last_status) {
+        if (rc->last_step >= 0)
+            rc->step[rc->last_step].ok++;
+        rc->errors = 0;
+        arm_in(rd);
+    }
+}
+
+/* Cancel the pending IN transfer and give the reader back to the kernel */
+void close_reader(struct reader *rd) {
+    cancel_in(rd);
+    libusb_release_interface(rd->devh, 0);
+    libusb_close(rd->devh);
+    rd->devh = NULL;
+    free(rd->cmdq);
+    rd->cmdq = NULL;
+    if (rd->id < METRICS_READERS) {
+        metrics_gauge(&metrics_gauges[rd->id].state, 0);
+        metrics_gauge(&metrics_gauges[rd->id].queued, 0);
+    }
+}
+
+static uint64_t poll_gap_ns(int level) {
+    return level ? (uint64_t)(POLL_MIN_GAP_US << (level - 1)) * 1000 : 0;
+}
+
+static void poll_init(int max_gap_ms) {
+    poll_max_gap_ms = max_gap_ms;
+    poll_levels = 1;
+    while (poll_levels < POLL_MAX_LEVELS
+            && poll_gap_ns(poll_levels) <= (uint64_t)max_gap_ms * 1000000)
+        poll_levels++;
+}
+
+/* Nanoseconds until the reader's next EM4100 read is due, 0 if it is */
+static int64_t poll_wait_ns(struct reader *rd, uint64_t now) {
+    if (!poll_max_gap_ms || rd->poll.next_ns <= now)
+        return 0;
+    return rd->poll.next_ns - now;
+}
+
+/* Account a read round trip that started at start_ns and pick the level
+ * for the next one from its answer */
+static void poll_update(struct reader *rd, uint64_t start_ns) {
+    struct poll_rate *p = &rd->poll;
+    struct poll_level *l = &p->lv[p->level];
+    uint64_t now = monotonic_ns();
+    uint64_t latency;
+
+    if (!poll_max_gap_ms)
+        return;
+    l->time_ns += now - (p->since_ns ? p->since_ns : start_ns);
+    p->since_ns = now;
+    l->polls++;
+    l->busy_ns += now - start_ns;
+
+    if (rd->answer[3] == CMD_EM4100ID_ANSWER
+            && rd->answer[2] - MESSAGE_STRUCTURE_SIZE - 1 > 0) {
+        /* the tag showed up somewhere after the previous empty answer */
+        if (p->empty && p->last_ns && rd->answer_ns > p->last_ns) {
+            latency = rd->answer_ns - p->last_ns;
+            l->detections++;
+            l->latency_ns += latency;
+            if (latency > l->latency_max_ns)
+                l->latency_max_ns = latency;
+        }
+        if (p->level)
+            log_debug("reader %u: poll level %d -> 0", rd->id, p->level);
+        p->level = 0;
+        p->idle = 0;
+        p->empty = 0;
+    } else {
+        p->empty = 1;
+        if (++p->idle >= POLL_IDLE_POLLS && p->level < poll_levels - 1) {
+            p->level++;
+            p->idle = 0;
+            log_debug("reader %u: poll level %d", rd->id, p->level);
+        }
+    }
+    p->last_ns = rd->answer_ns;
+    p->next_ns = now + poll_gap_ns(p->level);
+}
+
+/* Print the bus utilization and detection latency reached at each level */
+static void poll_report(struct reader *rd) {
+    struct poll_level *l;
+    char det[96];
+    int i;
+
+    if (!poll_max_gap_ms)
+        return;
+    for (i=0 ; i<poll_levels ; i++) {
+        l = &rd->poll.lv[i];
+        if (!l->polls)
+            continue;
+        if (l->detections)
+            snprintf(det, sizeof(det), ", %llu detections, latency avg %.2f ms max %.2f ms",
+                     (unsigned long long)l->detections, l->latency_ns / 1e6 / l->detections,
+                     l->latency_max_ns / 1e6);
+        log_info("reader %u level %d (gap %llu us): %.3f s, %llu polls, bus %.1f%%%s",
+                 rd->id, i, (unsigned long long)poll_gap_ns(i) / 1000, l->time_ns / 1e9,
+                 (unsigned long long)l->polls, l->time_ns ? 100.0 * l->busy_ns / l->time_ns : 100.0,
+                 l->detections ? det : "");
+    }
+}
+
+static const char *recover_names[RECOVER_STEPS] = {"clear halt", "resubmit", "port reset", "reopen"};
+
+static void recover_report(struct reader *rd) {
+    struct recover_step *st;
+    int i;
+
+    for (i=0 ; i<RECOVER_STEPS ; i++) {
+        st = &rd->recover.step[i];
+        if (!st->attempts)
+            continue;
+        log_info("reader %u: %-10s %6llu tries %6llu recovered  %8.2f ms avg %8.2f ms max",
+                 rd->id, recover_names[i], (unsigned long long)st->attempts, (unsigned long long)st->ok,
+                 st->time_ns / 1e6 / st->attempts, st->max_ns / 1e6);
+    }
+    if (rd->stale_reports)
+        log_info("reader %u: %llu stale reports dropped", rd->id,
+                 (unsigned long long)rd->stale_reports);
+}
+
+/* Add the latest answer to the reader's voting window and report its id
+ * once K of the last N answers agree on it. Only well formed EM4100
+ * answers count, and each answer only once. */
+static int vote_answer(struct reader *rd, uint8_t *id) {
+    struct vote *v = &rd->vote;
+    int msg_size = rd->answer[2];
+    int i, votes = 0;
+
+    if (rd->answer_ns == v->last_ns || rd->answer[3] != CMD_EM4100ID_ANSWER
+            || rd->answer[1] != MESSAGE_START_MARKER || msg_size > 47
+            || rd->answer[msg_size] != MESSAGE_END_MARKER || !answer_checksum_ok(rd->answer))
+        return -1;
+    v->last_ns = rd->answer_ns;
+
+    v->pos = (v->pos + 1) % vote_n;
+    v->tag[v->pos] = msg_size - MESSAGE_STRUCTURE_SIZE - 1 >= 5;
+    if (!v->tag[v->pos])
+        return -1;
+    memcpy(v->id[v->pos], &rd->answer[5], 5);
+
+    for (i=0 ; i<vote_n ; i++)
+        if (v->tag[i] && !memcmp(v->id[i], v->id[v->pos], 5))
+            votes++;
+    if (votes < vote_k)
+        return -1;
+    memcpy(id, v->id[v->pos], 5);
+    return 0;
+}
+
+/* Decode the EM4100 id carried by the reader's latest answer */
+static int answer_tag_id(struct reader *rd, uint8_t *id) {
+    int msg_size = rd->answer[2];
+
+    if (vote_n > 1)
+        return vote_answer(rd, id);
+    /* a badly framed answer is no answer */
+    if (rd->answer[1] != MESSAGE_START_MARKER || msg_size > 47
+            || rd->answer[msg_size] != MESSAGE_END_MARKER || !answer_checksum_ok(rd->answer)
+            || msg_size - MESSAGE_STRUCTURE_SIZE - 1 < 5)
+        return -1;
+    memcpy(id, &rd->answer[5], 5);
+    return 0;
+}
+
+/* Poll the reader for an EM4100 id, up to `retries` round trips.
+ * Returns 0 and fills id[5] when a tag answered, -1 otherwise. */
+int read_em4100id(struct reader *rd, uint8_t *id, int retries, int *attempts) {
+    uint8_t cmd[24] = {0};
+    int tag = -1;
+    int retry_cnt = retries;
+    struct reader_counters *rc;
+    uint64_t start_ns;
+
+    if (!reader_supports(rd, CMD_EM4100ID_READ))
+        return -1;
+    while ((tag < 0) && retry_cnt) {
+        prepare_message(cmd, ENDPOINT_OUT, CMD_EM4100ID_READ, NULL, 0);
+        start_ns = monotonic_ns();
+        rd->attempt = retries - retry_cnt;
+        send_message_async(rd, cmd);
+        poll_update(rd, start_ns);
+        if (!rd->last_status) {
+            /* interrupt_cb already checked the framing */
+            start_ns = monotonic_ns();
+            tag = answer_tag_id(rd, id);
+            lat_record(LAT_READ, LAT_DECODE, monotonic_ns() - start_ns);
+        }
+        retry_cnt--;
+    }
+    rd->attempt = 0;
+    if ((rc = metrics_reader(rd->id))) {
+        counter_add(tag < 0 ? &rc->notags : &rc->reads, 1);
+        counter_add(&rc->retries, retries - retry_cnt - 1);
+    }
+    if (attempts)
+        *attempts = retries - retry_cnt;
+    return tag;
+}
+
+void send_read_em4100id(struct reader *rd) {
+    uint8_t id[5];
+    uint64_t start_ns;
+
+    // flaky read, retry 10 times
+    if (read_em4100id(rd, id, READ_RETRIES, NULL) < 0) {
+        fprintf(stdout, "NOTAG\n");
+        return;
+    }
+    start_ns = monotonic_ns();
+    fprintf(stdout, "%02X%02X%02X%02X%02X\n",id[0],id[1],id[2],id[3],id[4]);
+    lat_record(LAT_READ, LAT_OUTPUT, monotonic_ns() - start_ns);
+}
+
+
+static void send_probe(struct reader *rd, uint8_t command, int cap) {
+    uint8_t cmd[24] = {0};
+    uint8_t test[2] = {0x00, 0x00};
+
+    prepare_message(cmd, ENDPOINT_OUT, command, test, command == CMD_TEST_DEVICE ? 2 : 0);
+    rd->health.probe_sent = cap;
+    send_message_async(rd, cmd);
+}
+
+/* Learn which probes the firmware understands and start health checks */
+void reader_probe(struct reader *rd) {
+    struct health *h = &rd->health;
+    char support[3 * sizeof(h->support) + 1] = "";
+    int i;
+
+    send_probe(rd, CMD_GET_SUPPORT, CAP_GET_SUPPORT);
+    if (h->caps & CAP_GET_SUPPORT)
+        send_probe(rd, CMD_TEST_DEVICE, CAP_TEST_DEVICE);
+    h->next_probe_ns = monotonic_ns() + HEALTH_PROBE_MS * 1000000ull;
+
+    if (log_on(LOG_DEBUG)) {
+        for (i=0 ; i<h->support_len ; i++)
+            sprintf(&support[3 * i], " %02x", h->support[i]);
+        log_debug("reader %u: GetSupport %s, TestDevice %s, support%s",
+                  rd->id, h->caps & CAP_GET_SUPPORT ? "yes" : "no",
+                  h->caps & CAP_TEST_DEVICE ? "yes" : "no", support);
+    }
+}
+
+/* Nanoseconds until the next health probe is due, -1 if never */
+static int64_t health_wait_ns(struct reader *rd, uint64_t now) {
+    if (!rd->health.next_probe_ns)
+        return -1;
+    return rd->health.next_probe_ns > now ? (int64_t)(rd->health.next_probe_ns - now) : 0;
+}
+
+void health_probe(struct reader *rd) {
+    uint8_t id[5];
+
+    if (rd->health.caps & CAP_TEST_DEVICE)
+        send_probe(rd, CMD_TEST_DEVICE, CAP_TEST_DEVICE);
+    else
+        read_em4100id(rd, id, 1, NULL);
+    rd->health.next_probe_ns = monotonic_ns() + HEALTH_PROBE_MS * 1000000ull;
+}
+
+void send_buzzer(struct reader *rd, uint8_t duration) {
+    uint8_t cmd[48] = {0};
+
+    if (!reader_supports(rd, CMD_BUZZER))
+        return;
+    prepare_message(cmd, ENDPOINT_OUT, CMD_BUZZER, &duration, 1);
+    send_message_async(rd, cmd);
+}
+
+
+void t55xx_reset(struct reader *rd) {
+    uint8_t cmd[24] = {0};
+    uint8_t reset[5] = {0x0, 0x0, 0x0, 0x0, 0x0};
+
+    prepare_message(cmd, ENDPOINT_OUT, CMD_T5557_BLOCK_WRITE, reset, 5);
+    send_message_async(rd, cmd);
+}
+
+/*  SS PP 11 22 33 44 BB
+
+    SS  Subcommand  (4 for write)   or matches t5557 specs
+    PP  Protection bit
+    11  8 first bits
+    22  8 second bits
+    33  8 third bits
+    44  8 forth bits
+    BB  block number
+*/
+void t55xx_block_write(struct reader *rd, int block, uint8_t* data_buf) {
+    uint8_t cmd[24] = {0};
+    uint8_t bw_buf[7] = {0};
+
+    bw_buf[0] = 0x04; //??
+    bw_buf[1] = 0x00; //??
+    memcpy(&bw_buf[2], data_buf, 4);
+    bw_buf[6] = block;
+
+    prepare_message(cmd, ENDPOINT_OUT, CMD_T5557_BLOCK_WRITE, bw_buf, 7);
+    send_message_async(rd, cmd);
+}
+
+void em4305_write_word(struct reader *rd, int word, uint8_t* data_buf) {
+    uint8_t cmd[24] = {0};
+    uint8_t ww_buf[7] = {0};
+
+    ww_buf[0] = 0x01; //write command
+    ww_buf[1] = word; //word index
+    memcpy(&ww_buf[2], data_buf, 4);
+    ww_buf[6] = 0x0;  // ??
+
+    prepare_message(cmd, ENDPOINT_OUT, CMD_EM4305_CMD, ww_buf, 7);
+    send_message_async(rd, cmd);
+}
+
+void em4305_login(struct reader *rd) {
+    uint8_t cmd[24] = {0};
+    uint8_t login[7] = {0x3, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
+
+    prepare_message(cmd, ENDPOINT_OUT, CMD_EM4305_CMD, login, 7);
+    send_message_async(rd, cmd);
+}
+
+int em4100_column_parity(uint8_t* hex_buf, int shift) {
+    int i, p=0;
+
+    for (i=0 ; i<5 ; i++) {
+        p += (hex_buf[i] >> (shift+4)) &1;
+        p += (hex_buf[i] >> shift) &1;
+    }
+    return p&1;
+}
+
+/* Expand a 5 byte id into the 64 bit EM4100 bitstream (header, row and column parity) */
+void hex_to_em4100_layout(uint8_t* hex_buf, uint8_t* out_buf) {
+    int p0,p1,p2,p3,p4,p5,p6,p7,p8,p9;
+    int pc0,pc1,pc2,pc3;
+    uint8_t ep[16] = {0,1,1,0, 1,0,0,1, 1,0,0,1, 0,1,1,0};
+
+    p0 = ep[hex_buf[0]  >> 4];
+    p1 = ep[hex_buf[0] & 0xf];
+    p2 = ep[hex_buf[1]  >> 4];
+    p3 = ep[hex_buf[1] & 0xf];
+    p4 = ep[hex_buf[2]  >> 4];
+    p5 = ep[hex_buf[2] & 0xf];
+    p6 = ep[hex_buf[3]  >> 4];
+    p7 = ep[hex_buf[3] & 0xf];
+    p8 = ep[hex_buf[4]  >> 4];
+    p9 = ep[hex_buf[4] & 0xf];
+
+    pc0 = em4100_column_parity(hex_buf, 3);
+    pc1 = em4100_column_parity(hex_buf, 2);
+    pc2 = em4100_column_parity(hex_buf, 1);
+    pc3 = em4100_column_parity(hex_buf, 0);
+
+    out_buf[0] = 0xff;
+    out_buf[1] = 0x80 | ((hex_buf[0]>>1)&0x78) | (p0<<2) | ((hex_buf[0]>>2)&0x03);
+    out_buf[2] = (hex_buf[0]<<6) | (p1<<5) | ((hex_buf[1]>>3)&30) | p2;
+    out_buf[3] = (hex_buf[1]<<4) | (p3<<3) | (hex_buf[2]>>5);
+    out_buf[4] = ((hex_buf[2]<<3)&0x80) | (p4<<6) | ((hex_buf[2]<<2)&0x3c) | (p5<<1) | (hex_buf[3]>>7);
+    out_buf[5] = ((hex_buf[3]<<1)&0xe0) | (p6<<4) | (hex_buf[3]&0xf);
+    out_buf[6] = (p7<<7) | ((hex_buf[4]>>1)&0x78) | (p8<<2) | ((hex_buf[4]>>2)&0x03);
+    out_buf[7] = (hex_buf[4]<<6) | (p9<<5) | (pc0<<4) | (pc1<<3) | (pc2<<2) | (pc3<<1);
+}
+
+#define WRITE_STEPS     4
+
+/* Send command `step` of the id write sequence. Returns the number of
+ * steps left, -1 for an unknown or unsupported format or minus the
+ * transfer status when the step's command failed. */
+int write_em4100id_step(struct reader *rd, uint8_t *hex_buf, int format, int step) {
+    uint8_t ds[8] = {0};
+    uint8_t em4100_config_t5577[4] = {0x00, 0x14, 0x80, 0x41};
+    uint8_t em4100_config_em4305[4] = {0xfa, 0x01, 0x80, 0x00};
+
+    hex_to_em4100_layout(hex_buf, ds);
+
+    if (!reader_supports(rd, format == EM4305_FORMAT ? CMD_EM4305_CMD : CMD_T5557_BLOCK_WRITE)) {
+        log_warn("reader %u does not support writing this tag format", rd->id);
+        return -1;
+    }
+    if (format == T5577_FORMAT) {
+        switch (step) {
+            /* write em4100 bitstream to block 1 and 2 */
+            case 0: t55xx_block_write(rd, 1, ds); break;
+            case 1: t55xx_block_write(rd, 2, &ds[4]); break;
+            /* write configuration in block 0 to emulate EM4100; RF/64, Manchester, max block = 2 */
+            case 2: t55xx_block_write(rd, 0, em4100_config_t5577); break;
+            /* reset tag */
+            case 3: t55xx_reset(rd); break;
+        }
+    } else if (format == EM4305_FORMAT) {
+        switch (step) {
+            /* login to em4305 tag */
+            case 0: em4305_login(rd); break;
+            /* write em4100 bitstream to word 5 and 6 */
+            case 1: em4305_write_word(rd, 5, ds); break;
+            case 2: em4305_write_word(rd, 6, &ds[4]); break;
+            /* write em4305 configuration word (4) */
+            case 3: em4305_write_word(rd, 4, em4100_config_em4305); break;
+        }
+    } else {
+        log_warn("Unknown or unsupported format %d", format);
+        return -1;
+    }
+    if (rd->last_status)
+        return -rd->last_status;
+    return WRITE_STEPS - step - 1;
+}
+
+/* Write the whole sequence, stopping at the first failed step */
+int send_write_em4100id(struct reader *rd, uint8_t *hex_buf, int format) {
+    int step = 0, left;
+
+    do {
+        left = write_em4100id_step(rd, hex_buf, format, step++);
+    } while (left > 0);
+    if (left < 0 && rd->last_status)
+        log_warn("write failed at step %d: %s", step - 1,
+                 rd->last_status <= LIBUSB_TRANSFER_OVERFLOW ? transfer_status_names[rd->last_status] : "unknown");
+    return left;
+}
+
+int hex_string_to_bytes(const char *hex_string, uint8_t *byte_array) {
+    int i;
+    unsigned int byte;
+
+    if (strlen(hex_string) != 10)
+        return -1;
+    for (i=0 ; i<5 ; i++) {
+        if (sscanf(&hex_string[i*2], "%2x", &byte) != 1)
+            return -1;
+        byte_array[i] = byte;
+    }
+    return 0;
+}
+
+
+/*
+ * Publish mode (-P): tag events are appended to a shared memory ring in
+ * /dev/shm that local consumers map and follow without any copy through
+ * the kernel. The layout and the consumer side are in rfid_ring.h.
+ */
+#define RING_SLOTS          1024
+
+static struct rfid_ring *ring = NULL;
+static int ring_efd[RFID_RING_MAX_CONSUMERS];
+static uint32_t ring_consumers = 0;     /* bitmap of attached consumers */
+static int ring_adopt = 0;              /* keep the ring of a process handing over */
+
+int ring_create(const char *name) {
+    size_t size = rfid_ring_size(RING_SLOTS);
+    int fd, i;
+
+    /* after a handover the consumers keep following the same ring */
+    fd = shm_open(name, O_RDWR | O_CREAT | (ring_adopt ? 0 : O_TRUNC), 0660);
+    if (fd < 0) {
+        fprintf(stderr, "shm_open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "ftruncate %s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        fprintf(stderr, "mmap %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if (ring_adopt && ring->magic == RFID_RING_MAGIC && ring->slots == RING_SLOTS) {
+        log_info("publishing tag events to /dev/shm/%s, %llu so far",
+                 name, (unsigned long long)atomic_load(&ring->head));
+        return 0;
+    }
+    ring->slots = RING_SLOTS;
+    ring->slot_size = sizeof(struct rfid_ring_slot);
+    ring->version = RFID_RING_VERSION;
+    /* a ring laid out differently starts over without the consumers
+       handed over; main() takes their index from the clients */
+    for (i=0 ; i<RFID_RING_MAX_CONSUMERS ; i++) {
+        if (ring_consumers & (1u << i))
+            close(ring_efd[i]);
+        ring_efd[i] = -1;
+    }
+    ring_consumers = 0;
+    /* consumers check the magic last */
+    atomic_thread_fence(memory_order_release);
+    ring->magic = RFID_RING_MAGIC;
+    log_info("publishing tag events to /dev/shm/%s", name);
+    return 0;
+}
+
+void ring_destroy(const char *name) {
+    int i;
+
+    if (!ring)
+        return;
+    for (i=0 ; i<RFID_RING_MAX_CONSUMERS ; i++)
+        if (ring_efd[i] >= 0)
+            close(ring_efd[i]);
+    munmap(ring, rfid_ring_size(ring->slots));
+    if (name)
+        shm_unlink(name);
+    ring = NULL;
+}
+
+/* Hand out a consumer index with its own eventfd, -1 when full */
+int ring_attach(int *efd) {
+    int i;
+
+    for (i=0 ; i<RFID_RING_MAX_CONSUMERS ; i++) {
+        if (!(ring_consumers & (1u << i)))
+            break;
+    }
+    if (i == RFID_RING_MAX_CONSUMERS)
+        return -1;
+    ring_efd[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring_efd[i] < 0)
+        return -1;
+    atomic_store(&ring->waiting[i], 0);
+    ring_consumers |= 1u << i;
+    *efd = ring_efd[i];
+    return i;
+}
+
+void ring_detach(int idx) {
+    ring_consumers &= ~(1u << idx);
+    atomic_store(&ring->waiting[idx], 0);
+    close(ring_efd[idx]);
+    ring_efd[idx] = -1;
+}
+
+void ring_publish(const struct rfid_tag_event *ev) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct rfid_ring_slot *s = &ring->slot[head & (ring->slots - 1)];
+    uint64_t one = 1;
+    uint32_t mask;
+    int i;
+
+    atomic_store_explicit(&s->seq, 2 * head + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->ev = *ev;
+    atomic_store_explicit(&s->seq, 2 * (head + 1), memory_order_release);
+    /* seq_cst pairs with the consumer setting waiting[] and then re-reading
+       head, so either it sees this event or we see its flag; the flag
+       check must be seq_cst too, a relaxed load may be ordered before
+       the head store */
+    atomic_store(&ring->head, head + 1);
+
+    for (mask = ring_consumers ; mask ; mask &= mask - 1) {
+        i = __builtin_ctz(mask);
+        if (atomic_load(&ring->waiting[i]) && atomic_exchange(&ring->waiting[i], 0))
+            if (write(ring_efd[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+                log_debug("ring wakeup %d failed", i);
+    }
+}
+
+
+/*
+ * Device requests coming from server clients. They are queued for the
+ * reader, served inline or by the I/O thread in threaded mode, and
+ * answered with a reply frame.
+ */
+struct dev_request {
+    uint32_t client;        /* srv_client.serial of the requester */
+    uint8_t type;
+    uint8_t len;
+    uint8_t payload[RFID_SRV_MAX_PAYLOAD];
+};
+
+struct dev_reply {
+    uint32_t client;
+    uint8_t type;
+    uint8_t len;
+    uint8_t payload[RFID_SRV_MAX_PAYLOAD];
+};
+
+/*
+ * Per reader command queue. Device requests do not run to completion when
+ * they arrive: they are queued and sent a command at a time between polls,
+ * so tag detection keeps going while they are served.
+ *
+ *  - reads go first
+ *  - feedback (the buzzer) is acknowledged as soon as it is queued and
+ *    silently dropped if it could not start before its deadline
+ *  - a write is a batch of WRITE_STEPS commands sent one per turn; once
+ *    its first command went out it is neither cancelled nor expired
+ *
+ * Feedback and writes take turns with the polls. In the idle gaps of -A
+ * polling they also run whenever their measured round trip ends before
+ * the next poll is due, so they add no detection latency there.
+ */
+#define CMDQ_SLOTS                  32
+#define CMDQ_READ                   0       /* priorities, lowest first */
+#define CMDQ_FEEDBACK               1
+#define CMDQ_WRITE                  2
+#define CMDQ_READ_DEADLINE_MS       1000
+#define CMDQ_FEEDBACK_DEADLINE_MS   300
+#define CMDQ_WRITE_DEADLINE_MS      5000
+
+struct cmd_item {
+    struct dev_request req;
+    int prio;
+    int step;                   /* commands already sent */
+    uint64_t deadline_ns;       /* latest start */
+};
+
+struct cmd_queue {
+    struct cmd_item item[CMDQ_SLOTS];   /* in arrival order */
+    int n;
+    int turn;                   /* a command ran since the last poll */
+};
+
+typedef void (*reply_fn)(const struct dev_reply *rep);
+
+static void cmdq_reply(reply_fn reply, uint32_t client, uint8_t type, uint8_t err) {
+    struct dev_reply rep;
+
+    rep.client = client;
+    rep.type = type;
+    rep.payload[0] = err;
+    rep.len = type == RFID_RSP_ERROR ? 1 : 0;
+    reply(&rep);
+}
+
+static void cmdq_remove(struct cmd_queue *q, int i) {
+    memmove(&q->item[i], &q->item[i+1], (q->n - i - 1) * sizeof(q->item[0]));
+    q->n--;
+}
+
+/* Drop the client's requests that have not started yet */
+static int cmdq_cancel(struct cmd_queue *q, uint32_t client, reply_fn reply) {
+    int i, n = 0;
+
+    for (i=q->n-1 ; i>=0 ; i--) {
+        if (q->item[i].req.client != client || q->item[i].step)
+            continue;
+        if (q->item[i].prio != CMDQ_FEEDBACK)
+            cmdq_reply(reply, client, RFID_RSP_ERROR, RFID_ERR_CANCELLED);
+        cmdq_remove(q, i);
+        n++;
+    }
+    return n;
+}
+
+/* Queue a device request (or RFID_REQ_CANCEL). Replies go through
+ * `reply`, right away for errors, feedback and cancels. */
+void cmdq_push(struct reader *rd, const struct dev_request *req, reply_fn reply) {
+    struct cmd_queue *q = rd->cmdq;
+    struct cmd_item *it;
+    struct dev_reply rep;
+
+    if (!q && !(q = rd->cmdq = calloc(1, sizeof(*q)))) {
+        cmdq_reply(reply, req->client, RFID_RSP_ERROR, RFID_ERR_BUSY);
+        return;
+    }
+    if (req->type == RFID_REQ_CANCEL) {
+        rep.client = req->client;
+        rep.type = RFID_RSP_OK;
+        rep.payload[0] = cmdq_cancel(q, req->client, reply);
+        rep.len = 1;
+        reply(&rep);
+        return;
+    }
+    if (req->type == RFID_REQ_WRITE && (req->len != 6
+            || (req->payload[0] != T5577_FORMAT && req->payload[0] != EM4305_FORMAT))) {
+        cmdq_reply(reply, req->client, RFID_RSP_ERROR, RFID_ERR_INVALID);
+        return;
+    }
+    /* nothing the firmware said it does not understand is queued */
+    if (!reader_supports(rd, req->type == RFID_REQ_READ ? CMD_EM4100ID_READ
+                         : req->type == RFID_REQ_BUZZER ? CMD_BUZZER
+                         : req->payload[0] == EM4305_FORMAT ? CMD_EM4305_CMD : CMD_T5557_BLOCK_WRITE)) {
+        cmdq_reply(reply, req->client, RFID_RSP_ERROR, RFID_ERR_UNAVAILABLE);
+        return;
+    }
+    if (q->n == CMDQ_SLOTS) {
+        cmdq_reply(reply, req->client, RFID_RSP_ERROR, RFID_ERR_BUSY);
+        return;
+    }
+
+    it = &q->item[q->n++];
+    it->req = *req;
+    it->step = 0;
+    switch (req->type) {
+        case RFID_REQ_READ:
+            it->prio = CMDQ_READ;
+            it->deadline_ns = monotonic_ns() + CMDQ_READ_DEADLINE_MS * 1000000ull;
+            break;
+        case RFID_REQ_BUZZER:
+            it->prio = CMDQ_FEEDBACK;
+            it->deadline_ns = monotonic_ns() + CMDQ_FEEDBACK_DEADLINE_MS * 1000000ull;
+            cmdq_reply(reply, req->client, RFID_RSP_OK, 0);
+            break;
+        default:
+            it->prio = CMDQ_WRITE;
+            it->deadline_ns = monotonic_ns() + CMDQ_WRITE_DEADLINE_MS * 1000000ull;
+            break;
+    }
+}
+
+/* Expire what can no longer start in time and return the next item */
+static int cmdq_pick(struct cmd_queue *q, uint64_t now, reply_fn reply) {
+    int i, best = -1;
+
+    for (i=q->n-1 ; i>=0 ; i--) {
+        if (!q->item[i].step && now > q->item[i].deadline_ns) {
+            if (q->item[i].prio != CMDQ_FEEDBACK)
+                cmdq_reply(reply, q->item[i].req.client, RFID_RSP_ERROR, RFID_ERR_EXPIRED);
+            log_debug("request %02x of client %u expired",
+                      q->item[i].req.type, q->item[i].req.client);
+            cmdq_remove(q, i);
+            if (best > i)
+                best--;
+            continue;
+        }
+        if (best < 0 || q->item[i].prio <= q->item[best].prio)
+            best = i;
+    }
+    return best;
+}
+
+/* Whether a queued command may go out now. `polling`: the caller also
+ * polls the reader for tags and calls cmdq_polled() after each poll. */
+int cmdq_ready(struct reader *rd, uint64_t now, int polling) {
+    struct cmd_queue *q = rd->cmdq;
+    struct cmd_item *it;
+    struct rtt *t;
+    int64_t idle;
+    int i;
+
+    /* asked before every turn of the owning thread, so sample here */
+    if (rd->id < METRICS_READERS)
+        metrics_gauge(&metrics_gauges[rd->id].queued, q ? q->n : 0);
+    if (!q || !q->n)
+        return 0;
+    if (!polling || !q->turn)
+        return 1;
+    for (i=1, it=&q->item[0] ; i<q->n ; i++)
+        if (q->item[i].prio < it->prio)
+            it = &q->item[i];
+    if (it->prio == CMDQ_READ)
+        return 1;
+    /* outside its turn a command must fit in the gap before the next poll */
+    idle = poll_wait_ns(rd, now);
+    if (it->req.type == RFID_REQ_BUZZER)
+        t = &rd->rtt[RTT_BUZZER];
+    else
+        t = &rd->rtt[it->req.payload[0] == EM4305_FORMAT ? RTT_EM4305 : RTT_T5577];
+    return t->srtt_us && idle > (int64_t)t->srtt_us * 1000;
+}
+
+void cmdq_polled(struct reader *rd) {
+    if (rd->cmdq)
+        rd->cmdq->turn = 0;
+}
+
+/* Send the next command of write item `i`; the last or a failed one
+ * answers the client and removes the item. Returns 1 while steps are left. */
+static int cmdq_write_step(struct reader *rd, int i, reply_fn reply) {
+    struct cmd_item *it = &rd->cmdq->item[i];
+    int left;
+
+    left = write_em4100id_step(rd, &it->req.payload[1], it->req.payload[0], it->step++);
+    if (left > 0)
+        return 1;
+    /* a failed step drops the rest of the sequence */
+    cmdq_reply(reply, it->req.client, left < 0 ? RFID_RSP_ERROR : RFID_RSP_OK,
+               !rd->last_status ? RFID_ERR_INVALID
+               : rd->last_status == LIBUSB_TRANSFER_TIMED_OUT ? RFID_ERR_TIMEOUT
+               : RFID_ERR_UNAVAILABLE);
+    cmdq_remove(rd->cmdq, i);
+    return 0;
+}
+
+/* Send one command of the most urgent request */
+void cmdq_run(struct reader *rd, reply_fn reply) {
+    struct cmd_queue *q = rd->cmdq;
+    struct cmd_item *it;
+    struct dev_reply rep;
+    int i;
+
+    if (!q || (i = cmdq_pick(q, monotonic_ns(), reply)) < 0)
+        return;
+    it = &q->item[i];
+    q->turn = 1;
+
+    switch (it->req.type) {
+        case RFID_REQ_READ:
+            rep.client = it->req.client;
+            rep.len = 0;
+            if (read_em4100id(rd, rep.payload, READ_RETRIES, NULL) < 0) {
+                rep.type = RFID_RSP_NOTAG;
+            } else {
+                rep.type = RFID_RSP_TAG;
+                rep.len = 5;
+            }
+            reply(&rep);
+            cmdq_remove(q, i);
+            break;
+        case RFID_REQ_BUZZER:
+            send_buzzer(rd, it->req.len >= 1 ? it->req.payload[0] : 9);
+            cmdq_remove(q, i);
+            break;
+        case RFID_REQ_WRITE:
+            cmdq_write_step(rd, i, reply);
+            break;
+    }
+}
+
+/* Run a write that already started to its end, so no tag is left half
+ * written when the queue goes away */
+void cmdq_finish(struct reader *rd, reply_fn reply) {
+    struct cmd_queue *q = rd->cmdq;
+    int i;
+
+    for (i=0 ; q && i<q->n ; i++) {
+        if (q->item[i].step) {
+            while (cmdq_write_step(rd, i, reply))
+                ;
+            i = -1;
+        }
+    }
+}
+
+
+/*
+ * Threaded mode (-T): a dedicated thread owns every libusb call and polls
+ * the reader back to back. Decoded reads reach each consumer through its
+ * own lock-free single producer/single consumer queue, so slow processing
+ * on the application side no longer delays the next poll.
+ *
+ * A consumer about to sleep sets its waker's `waiting` flag and re-checks
+ * its queues; producers only write the eventfd when that flag is set.
+ */
+#define SPSC_SLOTS          256
+#define IO_MAX_CONSUMERS    4
+
+struct waker {
+    _Atomic uint32_t waiting;
+    int efd;
+};
+
+struct spsc_queue {
+    _Atomic uint32_t head __attribute__((aligned(64)));     /* producer owned */
+    _Atomic uint32_t tail __attribute__((aligned(64)));     /* consumer owned */
+    uint32_t elem_size;
+    uint32_t dropped;
+    struct waker *waker;
+    uint8_t *buf;
+};
+
+static int waker_init(struct waker *w) {
+    atomic_init(&w->waiting, 0);
+    w->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return w->efd < 0 ? -1 : 0;
+}
+
+static void waker_wake(struct waker *w) {
+    uint64_t one = 1;
+
+    /* seq_cst like the queue publish before it, or the load could pass
+       it and miss a consumer that just went to sleep */
+    if (w && atomic_load(&w->waiting) && atomic_exchange(&w->waiting, 0))
+        if (write(w->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_debug("wakeup failed");
+}
+
+static void waker_clear(struct waker *w) {
+    uint64_t v;
+
+    if (read(w->efd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        log_debug("wakeup read failed");
+}
+
+static int spsc_init(struct spsc_queue *q, uint32_t elem_size, struct waker *w) {
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->elem_size = elem_size;
+    q->dropped = 0;
+    q->waker = w;
+    q->buf = calloc(SPSC_SLOTS, elem_size);
+    return q->buf ? 0 : -1;
+}
+
+static int spsc_empty(struct spsc_queue *q) {
+    return atomic_load(&q->head) == atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
+
+/* Producer side; a full queue drops the element rather than blocking */
+static int spsc_push(struct spsc_queue *q, const void *elem) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&q->tail, memory_order_acquire) == SPSC_SLOTS) {
+        q->dropped++;
+        return -1;
+    }
+    memcpy(&q->buf[(head & (SPSC_SLOTS - 1)) * q->elem_size], elem, q->elem_size);
+    /* seq_cst against the consumer's waiting flag, see struct waker */
+    atomic_store(&q->head, head + 1);
+    waker_wake(q->waker);
+    return 0;
+}
+
+/* Block on the waker until `q` gets data or timeout_ns (-1: forever) passed */
+static void waker_sleep(struct waker *w, struct spsc_queue *q, int64_t timeout_ns) {
+    struct pollfd pfd;
+    struct timespec tmo;
+
+    pfd.fd = w->efd;
+    pfd.events = POLLIN;
+    tmo.tv_sec = timeout_ns / 1000000000;
+    tmo.tv_nsec = timeout_ns % 1000000000;
+    atomic_store(&w->waiting, 1);
+    if (spsc_empty(q))
+        ppoll(&pfd, 1, timeout_ns < 0 ? NULL : &tmo, NULL);
+    atomic_store(&w->waiting, 0);
+    waker_clear(w);
+}
+
+/* Consumer side; returns 0 when the queue is empty */
+static int spsc_pop(struct spsc_queue *q, void *elem) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+        return 0;
+    memcpy(elem, &q->buf[(tail & (SPSC_SLOTS - 1)) * q->elem_size], q->elem_size);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+struct io_thread {
+    pthread_t thread;
+    int cpu;                                /* -1: no pinning */
+    struct reader *rd;
+    struct spsc_queue requests;             /* application -> I/O thread */
+    struct waker waker;                     /* wakes a thread paced by -A */
+    struct spsc_queue replies;              /* I/O thread -> application */
+    struct spsc_queue events[IO_MAX_CONSUMERS];
+    int num_consumers;
+    _Atomic int paused;                     /* io_pause(): leave the reader alone */
+};
+
+static struct io_thread *io = NULL;
+
+static void io_reply(const struct dev_reply *rep) {
+    spsc_push(&io->replies, rep);
+}
+
+static void *io_thread_main(void *arg) {
+    struct io_thread *t = arg;
+    struct dev_request req;
+    struct rfid_tag_event ev;
+    int64_t wait_ns, probe_ns;
+    uint64_t now;
+    int attempts, i;
+    cpu_set_t set;
+
+    if (t->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            log_warn("could not pin I/O thread to cpu %d", t->cpu);
+    }
+
+    if (!t->rd->health.next_probe_ns)
+        reader_probe(t->rd);
+    while (running && !atomic_load(&t->paused)) {
+        while (spsc_pop(&t->requests, &req))
+            cmdq_push(t->rd, &req, io_reply);
+        now = monotonic_ns();
+        if ((probe_ns = health_wait_ns(t->rd, now)) == 0) {
+            health_probe(t->rd);
+            continue;
+        }
+        if (cmdq_ready(t->rd, now, 1)) {
+            cmdq_run(t->rd, io_reply);
+            continue;
+        }
+        if ((wait_ns = poll_wait_ns(t->rd, now)) > 0) {
+            waker_sleep(&t->waker, &t->requests, probe_ns > 0 && probe_ns < wait_ns ? probe_ns : wait_ns);
+            continue;
+        }
+        cmdq_polled(t->rd);
+        if (read_em4100id(t->rd, ev.id, 1, &attempts) == 0) {
+            ev.timestamp_ns = t->rd->answer_ns;
+            ev.reader = 0;
+            ev.attempts = attempts;
+            ev.flags = 0;
+            for (i=0 ; i<t->num_consumers ; i++)
+                spsc_push(&t->events[i], &ev);
+        }
+    }
+    return NULL;
+}
+
+/* Create the I/O thread state; consumers are added before io_start() */
+int io_init(struct reader *rd, int cpu) {
+    io = calloc(1, sizeof(*io));
+    if (!io)
+        return -1;
+    io->rd = rd;
+    io->cpu = cpu;
+    /* the I/O thread picks requests up between polls, it only sleeps
+     * while -A paces them */
+    if (waker_init(&io->waker) < 0
+            || spsc_init(&io->requests, sizeof(struct dev_request), &io->waker) < 0)
+        return -1;
+    return 0;
+}
+
+/* Register a consumer; `w` is woken when its queue (and, for the first
+ * consumer, the reply queue) gets data */
+struct spsc_queue *io_add_consumer(struct waker *w) {
+    struct spsc_queue *q;
+
+    if (io->num_consumers == IO_MAX_CONSUMERS)
+        return NULL;
+    q = &io->events[io->num_consumers];
+    if (spsc_init(q, sizeof(struct rfid_tag_event), w) < 0)
+        return NULL;
+    if (io->num_consumers++ == 0
+            && spsc_init(&io->replies, sizeof(struct dev_reply), w) < 0)
+        return NULL;
+    return q;
+}
+
+int io_start(void) {
+    sigset_t set, old;
+    int r;
+
+    /* keep SIGINT/SIGTERM on the application thread so its poll() wakes up */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    r = pthread_create(&io->thread, NULL, io_thread_main, io);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0) {
+        fprintf(stderr, "could not start I/O thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop the I/O thread but keep its queues; io_resume() starts it again */
+static void io_pause(void) {
+    atomic_store(&io->paused, 1);
+    waker_wake(&io->waker);
+    pthread_join(io->thread, NULL);
+}
+
+static int io_resume(void) {
+    atomic_store(&io->paused, 0);
+    return io_start();
+}
+
+void io_stop(void) {
+    int i;
+
+    if (!io)
+        return;
+    running = 0;
+    if (!atomic_load(&io->paused)) {
+        waker_wake(&io->waker);
+        pthread_join(io->thread, NULL);
+    }
+    close(io->waker.efd);
+    for (i=0 ; i<io->num_consumers ; i++) {
+        if (io->events[i].dropped)
+            log_warn("consumer %d dropped %u events", i, io->events[i].dropped);
+        free(io->events[i].buf);
+    }
+    free(io->replies.buf);
+    free(io->requests.buf);
+    free(io);
+    io = NULL;
+}
+
+
+/*
+ * Timing profiles (-t <file>): the idle time each command type needs
+ * before the reader takes the next command, one line per reader keyed by
+ * its USB path, gaps in microseconds:
+ *
+ *   <bus>-<port>[.<port>...] <read> <block write> <word write> <reset> <buzzer>
+ *
+ * Without a profile there is no gap. -c measures the gaps of the reader
+ * against a test tag held in the field and saves them.
+ */
+#define CAL_TRIALS              10
+#define TIMING_LINE_LEN         128
+
+static const uint32_t cal_gaps_us[] = {0, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000};
+static const char *timing_names[TIMING_CLASSES] = {"read", "block write", "word write", "reset", "buzzer"};
+
+static char *timing_path = NULL;
+
+static void usb_path_string(libusb_device *dev, char *buf, size_t len) {
+    uint8_t ports[8];
+    int i, n, off;
+
+    off = snprintf(buf, len, "%d", libusb_get_bus_number(dev));
+    n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for (i=0 ; i<n && off < (int)len ; i++)
+        off += snprintf(&buf[off], len - off, "%c%d", i ? '.' : '-', ports[i]);
+}
+
+/* Apply the reader's gaps from the profile file, if it has a line */
+int timing_load(struct reader *rd, libusb_device *dev) {
+    char line[TIMING_LINE_LEN], path[32], key[32];
+    uint32_t g[TIMING_CLASSES];
+    FILE *f;
+    int found = 0;
+
+    if (!timing_path || !(f = fopen(timing_path, "r")))
+        return -1;
+    usb_path_string(dev, path, sizeof(path));
+    while (!found && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%31s %u %u %u %u %u", key, &g[0], &g[1], &g[2], &g[3], &g[4]) == 6
+                && !strcmp(key, path)) {
+            memcpy(rd->timing.gap_us, g, sizeof(g));
+            found = 1;
+        }
+    }
+    fclose(f);
+    if (found)
+        log_debug("reader %s: gaps %u %u %u %u %u us", path, g[0], g[1], g[2], g[3], g[4]);
+    return found ? 0 : -1;
+}
+
+/* Replace (or add) the reader's line in the profile file */
+int timing_save(struct reader *rd, libusb_device *dev) {
+    char line[TIMING_LINE_LEN], path[32], key[32], tmp[256];
+    uint32_t *g = rd->timing.gap_us;
+    FILE *in, *out;
+
+    usb_path_string(dev, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", timing_path);
+    if (!(out = fopen(tmp, "w"))) {
+        fprintf(stderr, "could not write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    if ((in = fopen(timing_path, "r"))) {
+        while (fgets(line, sizeof(line), in))
+            if (sscanf(line, "%31s", key) != 1 || strcmp(key, path))
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s %u %u %u %u %u\n", path, g[0], g[1], g[2], g[3], g[4]);
+    if (fclose(out) != 0 || rename(tmp, timing_path) < 0) {
+        fprintf(stderr, "could not write %s: %s\n", timing_path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* One command of type `cls`, then the test tag must read back within the
+ * next two reads. Writes put back the data the tag already holds. */
+static int cal_trial(struct reader *rd, int cls, const uint8_t *id, uint8_t *ds) {
+    uint8_t got[5];
+
+    switch (cls) {
+        case TIMING_BLOCK_WRITE:
+            t55xx_block_write(rd, 1, ds);
+            break;
+        case TIMING_WORD_WRITE:
+            em4305_write_word(rd, 5, ds);
+            break;
+        case TIMING_RESET:
+            t55xx_reset(rd);
+            break;
+        case TIMING_BUZZER:
+            send_buzzer(rd, 1);
+            break;
+        default:
+            break;
+    }
+    if (rd->last_status || read_em4100id(rd, got, 2, NULL) < 0)
+        return 0;
+    return !memcmp(got, id, 5);
+}
+
+/* Sweep the gap of every command type from short to long and keep the
+ * first one at which all trials succeed. Write types are only exercised
+ * when the test tag's format is given, on a tag that already carries the
+ * id it reads as. */
+int calibrate(struct reader *rd, int format) {
+    uint8_t id[5], ds[8];
+    int cls, i, t, ok;
+
+    if (read_em4100id(rd, id, READ_RETRIES, NULL) < 0) {
+        fprintf(stderr, "calibration needs a test tag in the field\n");
+        return -1;
+    }
+    hex_to_em4100_layout(id, ds);
+    if (format == EM4305_FORMAT)
+        em4305_login(rd);
+
+    for (cls=0 ; cls<TIMING_CLASSES ; cls++) {
+        if ((cls == TIMING_BLOCK_WRITE || cls == TIMING_RESET) && format != T5577_FORMAT)
+            continue;
+        if (cls == TIMING_WORD_WRITE && format != EM4305_FORMAT)
+            continue;
+        for (i=0 ; i<(int)(sizeof(cal_gaps_us) / sizeof(cal_gaps_us[0])) ; i++) {
+            rd->timing.gap_us[cls] = cal_gaps_us[i];
+            for (t=0, ok=0 ; t<CAL_TRIALS && running ; t++)
+                ok += cal_trial(rd, cls, id, ds);
+            fprintf(stdout, "%-12s gap %6u us: %d/%d\n", timing_names[cls], cal_gaps_us[i], ok, CAL_TRIALS);
+            if (ok == CAL_TRIALS || !running)
+                break;
+        }
+    }
+    fprintf(stdout, "gaps (us): read %u, block write %u, word write %u, reset %u, buzzer %u\n",
+            rd->timing.gap_us[0], rd->timing.gap_us[1], rd->timing.gap_us[2],
+            rd->timing.gap_us[3], rd->timing.gap_us[4]);
+    return 0;
+}
+
+
+/*
+ * Fleet mode (-N <workers>): readers are spread over worker threads, each
+ * with its own libusb context and event loop, so a rig with dozens of
+ * readers is not serialized behind one context. The application thread
+ * scans the bus, hands new readers to the least loaded worker and moves
+ * readers when the load gets uneven; workers report readers they lost.
+ * Every worker feeds its own SPSC queue, drained into one output stream.
+ */
+#define FLEET_MAX_WORKERS   64
+#define FLEET_MAX_READERS   256
+#define FLEET_SCAN_MS       1000
+#define FLEET_PATH_LEN      8           /* bus number + up to 7 port numbers */
+
+#define EV_READER_LOST      0x80        /* rfid_tag_event.flags, worker -> application only */
+
+enum { FLEET_ATTACH, FLEET_DETACH };
+
+struct fleet_cmd {
+    uint8_t op;
+    uint8_t path_len;
+    uint8_t path[FLEET_PATH_LEN];
+    uint32_t reader;
+};
+
+struct worker {
+    pthread_t thread;
+    int idx;
+    libusb_context *ctx;
+    struct waker waker;                 /* wakes an idle worker for commands */
+    struct spsc_queue cmds;             /* application -> worker */
+    struct spsc_queue events;           /* worker -> application */
+    struct reader *readers[FLEET_MAX_READERS];
+    int num_readers;
+};
+
+/* Application side view of a reader, kept after it leaves so that a
+ * replugged reader gets its old id back */
+struct fleet_reader {
+    uint8_t path_len;
+    uint8_t path[FLEET_PATH_LEN];
+    uint32_t id;
+    int worker;                         /* -1: not attached */
+    int present;
+};
+
+static struct worker *workers = NULL;
+static int num_workers = 0;
+static struct fleet_reader fleet[FLEET_MAX_READERS];
+static int fleet_size = 0;
+static uint64_t fleet_next_scan = 0;
+
+/* Bus number followed by the port path, stable across replugs */
+static int usb_path(libusb_device *dev, uint8_t *path) {
+    int n;
+
+    path[0] = libusb_get_bus_number(dev);
+    n = libusb_get_port_numbers(dev, &path[1], FLEET_PATH_LEN - 1);
+    return n < 0 ? -1 : n + 1;
+}
+
+/* Readers sharing a context complete in any order relative to the poll
+ * loop, so events are pushed from interrupt_cb: each worker's stream is
+ * then ordered by completion time, which the merge stage relies on. */
+static void worker_answer(struct reader *rd) {
+    struct worker *w = rd->user;
+    struct rfid_tag_event ev;
+
+    if (rd->answer[3] != CMD_EM4100ID_ANSWER || answer_tag_id(rd, ev.id) < 0)
+        return;
+    ev.timestamp_ns = rd->answer_ns;
+    ev.reader = rd->id;
+    ev.attempts = 1;
+    ev.flags = 0;
+    spsc_push(&w->events, &ev);
+}
+
+static struct reader *worker_open(struct worker *w, const struct fleet_cmd *cmd) {
+    libusb_device **devs;
+    struct reader *rd = NULL;
+    uint8_t path[FLEET_PATH_LEN];
+    ssize_t n;
+    int i, r, tries;
+
+    n = libusb_get_device_list(w->ctx, &devs);
+    for (i=0 ; i<n ; i++) {
+        if (usb_path(devs[i], path) == cmd->path_len && !memcmp(path, cmd->path, cmd->path_len))
+            break;
+    }
+    if (i >= n)
+        goto out;
+    rd = calloc(1, sizeof(*rd));
+    if (!rd)
+        goto out;
+    rd->ctx = w->ctx;
+    rd->id = cmd->reader;
+    rd->on_answer = worker_answer;
+    rd->user = w;
+    if (libusb_open(devs[i], &rd->devh) < 0)
+        goto fail;
+    r = libusb_detach_kernel_driver(rd->devh, 0);
+    if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND && r != LIBUSB_ERROR_NOT_SUPPORTED)
+        goto fail_close;
+    /* when the reader is moving between workers the old one may not have
+       released it yet */
+    for (tries=0 ; (r = libusb_claim_interface(rd->devh, 0)) == LIBUSB_ERROR_BUSY && tries<20 ; tries++)
+        usleep(5 * 1000);
+    if (r < 0)
+        goto fail_close;
+    init_protocol(rd);
+    timing_load(rd, devs[i]);
+    reader_probe(rd);
+    goto out;
+
+fail_close:
+    libusb_close(rd->devh);
+fail:
+    log_warn("worker %d: could not claim reader %u", w->idx, cmd->reader);
+    free(rd);
+    rd = NULL;
+out:
+    libusb_free_device_list(devs, 1);
+    return rd;
+}
+
+static void worker_drop(struct worker *w, int i) {
+    poll_report(w->readers[i]);
+    recover_report(w->readers[i]);
+    close_reader(w->readers[i]);
+    free(w->readers[i]);
+    w->readers[i] = w->readers[--w->num_readers];
+}
+
+static void worker_command(struct worker *w, const struct fleet_cmd *cmd) {
+    struct reader *rd;
+    int i;
+
+    if (cmd->op == FLEET_ATTACH) {
+        if (w->num_readers < FLEET_MAX_READERS && (rd = worker_open(w, cmd)))
+            w->readers[w->num_readers++] = rd;
+        log_info("worker %d: attach reader %u", w->idx, cmd->reader);
+        return;
+    }
+    for (i=0 ; i<w->num_readers ; i++) {
+        if (w->readers[i]->id == cmd->reader) {
+            worker_drop(w, i);
+            log_info("worker %d: detach reader %u", w->idx, cmd->reader);
+            return;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct fleet_cmd cmd;
+    struct rfid_tag_event ev;
+    struct reader *rd;
+    int64_t wait_ns, due_ns, probe_ns;
+    uint64_t now;
+    int i;
+
+    while (running) {
+        while (spsc_pop(&w->cmds, &cmd))
+            worker_command(w, &cmd);
+
+        if (!w->num_readers) {
+            waker_sleep(&w->waker, &w->cmds, 100000000);
+            continue;
+        }
+
+        /* tags are reported by worker_answer(); with -A the worker sleeps
+         * once no reader is due */
+        wait_ns = -1;
+        for (i=0 ; i<w->num_readers ; i++) {
+            rd = w->readers[i];
+            now = monotonic_ns();
+            probe_ns = health_wait_ns(rd, now);
+            if (probe_ns == 0) {
+                health_probe(rd);
+            } else if ((due_ns = poll_wait_ns(rd, now)) == 0) {
+                read_em4100id(rd, ev.id, 1, NULL);
+            } else {
+                if (probe_ns > 0 && probe_ns < due_ns)
+                    due_ns = probe_ns;
+                if (wait_ns != 0 && (wait_ns < 0 || due_ns < wait_ns))
+                    wait_ns = due_ns;
+                continue;
+            }
+            wait_ns = 0;
+            /* a dead reader is dropped like an unplugged one; the next
+               scan attaches it again if it is still on the bus */
+            if (rd->last_status == LIBUSB_TRANSFER_NO_DEVICE
+                    || rd->health.state == READER_DEAD) {
+                memset(&ev, 0, sizeof(ev));
+                ev.timestamp_ns = monotonic_ns();
+                ev.reader = rd->id;
+                ev.flags = EV_READER_LOST;
+                spsc_push(&w->events, &ev);
+                worker_drop(w, i--);
+            }
+        }
+        if (wait_ns > 0)
+            waker_sleep(&w->waker, &w->cmds, wait_ns);
+    }
+
+    while (w->num_readers)
+        worker_drop(w, 0);
+    return NULL;
+}
+
+/* Allocate `n` workers with their own libusb context; fleet_start()
+ * launches them once the consumer side is known */
+int fleet_init(int n) {
+    int i;
+
+    if (n < 1 || n > FLEET_MAX_WORKERS)
+        return -1;
+    workers = calloc(n, sizeof(*workers));
+    if (!workers)
+        return -1;
+    for (i=0 ; i<n ; i++) {
+        workers[i].idx = i;
+        if (libusb_init(&workers[i].ctx) < 0
+                || waker_init(&workers[i].waker) < 0
+                || spsc_init(&workers[i].cmds, sizeof(struct fleet_cmd), &workers[i].waker) < 0)
+            return -1;
+        num_workers++;
+    }
+    return 0;
+}
+
+int fleet_start(struct waker *w) {
+    sigset_t set, old;
+    int i, r = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (i=0 ; i<num_workers && !r ; i++) {
+        if (spsc_init(&workers[i].events, sizeof(struct rfid_tag_event), w) < 0
+                || pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            r = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r < 0)
+        fprintf(stderr, "could not start fleet workers\n");
+    return r;
+}
+
+void fleet_stop(void) {
+    int i;
+
+    running = 0;
+    for (i=0 ; i<num_workers ; i++) {
+        waker_wake(&workers[i].waker);
+        if (workers[i].thread)
+            pthread_join(workers[i].thread, NULL);
+        if (workers[i].events.dropped)
+            log_warn("worker %d dropped %u events", i, workers[i].events.dropped);
+        free(workers[i].events.buf);
+        free(workers[i].cmds.buf);
+        close(workers[i].waker.efd);
+        libusb_exit(workers[i].ctx);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+}
+
+static void fleet_send(int w, int op, struct fleet_reader *fr) {
+    struct fleet_cmd cmd;
+
+    cmd.op = op;
+    cmd.path_len = fr->path_len;
+    memcpy(cmd.path, fr->path, FLEET_PATH_LEN);
+    cmd.reader = fr->id;
+    if (spsc_push(&workers[w].cmds, &cmd) < 0) {
+        log_warn("worker %d command queue full", w);
+        return;
+    }
+    fr->worker = op == FLEET_ATTACH ? w : -1;
+}
+
+static void fleet_loads(int *load) {
+    int i;
+
+    memset(load, 0, num_workers * sizeof(int));
+    for (i=0 ; i<fleet_size ; i++)
+        if (fleet[i].worker >= 0)
+            load[fleet[i].worker]++;
+}
+
+/* Attach readers without a worker to the least loaded one, then move
+ * readers off the busiest worker until loads differ by at most one */
+static void fleet_balance(void) {
+    int load[FLEET_MAX_WORKERS];
+    int i, w, lo, hi;
+
+    fleet_loads(load);
+    for (i=0 ; i<fleet_size ; i++) {
+        if (!fleet[i].present || fleet[i].worker >= 0)
+            continue;
+        for (lo=0, w=1 ; w<num_workers ; w++)
+            if (load[w] < load[lo])
+                lo = w;
+        fleet_send(lo, FLEET_ATTACH, &fleet[i]);
+        load[lo]++;
+    }
+
+    for (;;) {
+        for (lo=0, hi=0, w=1 ; w<num_workers ; w++) {
+            if (load[w] < load[lo])
+                lo = w;
+            if (load[w] > load[hi])
+                hi = w;
+        }
+        if (load[hi] - load[lo] <= 1)
+            break;
+        for (i=0 ; i<fleet_size && fleet[i].worker != hi ; i++)
+            ;
+        log_info("moving reader %u from worker %d to %d", fleet[i].id, hi, lo);
+        fleet_send(hi, FLEET_DETACH, &fleet[i]);
+        fleet_send(lo, FLEET_ATTACH, &fleet[i]);
+        load[hi]--;
+        load[lo]++;
+    }
+}
+
+/* Look for readers that came or went since the last scan */
+void fleet_scan(void) {
+    libusb_device **devs;
+    struct libusb_device_descriptor desc;
+    uint8_t path[FLEET_PATH_LEN];
+    ssize_t n;
+    int i, j, len;
+
+    for (j=0 ; j<fleet_size ; j++)
+        fleet[j].present = 0;
+
+    n = libusb_get_device_list(NULL, &devs);
+    for (i=0 ; i<n ; i++) {
+        if (libusb_get_device_descriptor(devs[i], &desc) < 0
+                || desc.idVendor != VENDOR_ID || desc.idProduct != PRODUCT_ID)
+            continue;
+        if ((len = usb_path(devs[i], path)) < 0)
+            continue;
+        memset(&path[len], 0, FLEET_PATH_LEN - len);
+        for (j=0 ; j<fleet_size ; j++)
+            if (fleet[j].path_len == len && !memcmp(fleet[j].path, path, len))
+                break;
+        if (j == fleet_size) {
+            if (fleet_size == FLEET_MAX_READERS)
+                continue;
+            fleet[j].path_len = len;
+            memcpy(fleet[j].path, path, FLEET_PATH_LEN);
+            fleet[j].id = j;
+            fleet[j].worker = -1;
+            fleet_size++;
+            log_info("new reader %u on bus %d", fleet[j].id, path[0]);
+        }
+        fleet[j].present = 1;
+    }
+    if (n >= 0)
+        libusb_free_device_list(devs, 1);
+
+    for (j=0 ; j<fleet_size ; j++)
+        if (!fleet[j].present && fleet[j].worker >= 0)
+            fleet_send(fleet[j].worker, FLEET_DETACH, &fleet[j]);
+
+    fleet_balance();
+    fleet_next_scan = monotonic_ns() + FLEET_SCAN_MS * 1000000ull;
+}
+
+/* A worker dropped a reader it could no longer talk to */
+static void fleet_reader_lost(uint32_t id) {
+    if (id < (uint32_t)fleet_size) {
+        fleet[id].worker = -1;
+        fleet[id].present = 0;
+    }
+}
+
+static int64_t fleet_scan_wait_ns(uint64_t now) {
+    return fleet_next_scan > now ? (int64_t)(fleet_next_scan - now) : 0;
+}
+
+
+/*
+ * Merge stage: every source delivers its events in timestamp order, but
+ * sources race each other. The head event of each source sits in a binary
+ * min-heap keyed by its interrupt_cb completion time. The oldest head is
+ * released as soon as every source has a head, otherwise once it has waited
+ * out the reordering window, so the output is globally time ordered for
+ * sources that lag less than the window. Fixed size, no allocation.
+ */
+#define MERGE_WINDOW_US     500
+
+struct merge {
+    int k;
+    struct spsc_queue **src;
+    int n;                                  /* heads in the heap */
+    int heap[FLEET_MAX_WORKERS];            /* source indices */
+    int in_heap[FLEET_MAX_WORKERS];
+    struct rfid_tag_event head[FLEET_MAX_WORKERS];
+    uint64_t window_ns;
+};
+
+static uint64_t merge_window_us = MERGE_WINDOW_US;
+
+static int merge_less(struct merge *m, int a, int b) {
+    return m->head[m->heap[a]].timestamp_ns < m->head[m->heap[b]].timestamp_ns;
+}
+
+static void merge_swap(struct merge *m, int a, int b) {
+    int t = m->heap[a];
+    m->heap[a] = m->heap[b];
+    m->heap[b] = t;
+}
+
+static void merge_sift_up(struct merge *m, int i) {
+    while (i > 0 && merge_less(m, i, (i - 1) / 2)) {
+        merge_swap(m, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void merge_sift_down(struct merge *m, int i) {
+    int c;
+
+    while ((c = 2 * i + 1) < m->n) {
+        if (c + 1 < m->n && merge_less(m, c + 1, c))
+            c++;
+        if (!merge_less(m, c, i))
+            break;
+        merge_swap(m, i, c);
+        i = c;
+    }
+}
+
+static void merge_init(struct merge *m, struct spsc_queue **src, int k, uint64_t window_us) {
+    memset(m, 0, sizeof(*m));
+    m->src = src;
+    m->k = k;
+    m->window_ns = window_us * 1000;
+}
+
+/* Pull the next head of every source that has none in the heap */
+static void merge_fill(struct merge *m) {
+    int i;
+
+    for (i=0 ; i<m->k ; i++) {
+        if (m->in_heap[i] || !spsc_pop(m->src[i], &m->head[i]))
+            continue;
+        m->in_heap[i] = 1;
+        m->heap[m->n] = i;
+        merge_sift_up(m, m->n++);
+    }
+}
+
+/* Release the oldest event if it can no longer be overtaken */
+static int merge_next(struct merge *m, uint64_t now, struct rfid_tag_event *ev) {
+    int top;
+
+    merge_fill(m);
+    if (!m->n)
+        return 0;
+    top = m->heap[0];
+    if (m->n < m->k && now < m->head[top].timestamp_ns + m->window_ns)
+        return 0;
+    *ev = m->head[top];
+    m->in_heap[top] = 0;
+    m->heap[0] = m->heap[--m->n];
+    merge_sift_down(m, 0);
+    return 1;
+}
+
+/* How long the oldest held event still waits, -1 when nothing is held */
+static int64_t merge_wait_ns(struct merge *m, uint64_t now) {
+    uint64_t due;
+
+    if (!m->n)
+        return -1;
+    due = m->head[m->heap[0]].timestamp_ns + m->window_ns;
+    return due > now ? (int64_t)(due - now) : 0;
+}
+
+
+/*
+ * Server mode (-S): this process owns the claimed reader and serves
+ * requests from local clients over a Unix stream socket, so that several
+ * services can share one device. The wire format is in rfid_server.h.
+ */
+#define SRV_MAX_CLIENTS     32
+
+struct srv_client {
+    int fd;
+    uint32_t serial;        /* tags replies coming back from the I/O thread */
+    int subscribed;
+    int ring_idx;           /* consumer index in the -P ring, -1 if none */
+    int in_len;
+    uint8_t in_buf[RFID_SRV_HDR_SIZE + RFID_SRV_MAX_PAYLOAD];
+};
+
+static struct srv_client clients[SRV_MAX_CLIENTS];
+static int num_clients = 0;
+static struct reader *srv_reader = NULL;   /* inline mode: the reader served */
+static uint32_t handover_client = 0;    /* serial of a client asking for the reader (-R) */
+static int num_subscribers = 0;
+static uint32_t client_serial = 0;
+
+static int srv_send(struct srv_client *c, uint8_t type, const void *payload, uint8_t len) {
+    uint8_t frame[RFID_SRV_HDR_SIZE + RFID_SRV_MAX_PAYLOAD];
+
+    frame[0] = type;
+    frame[1] = len;
+    if (len)
+        memcpy(&frame[RFID_SRV_HDR_SIZE], payload, len);
+    return send(c->fd, frame, RFID_SRV_HDR_SIZE + len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void srv_deliver_reply(const struct dev_reply *rep) {
+    int i;
+
+    for (i=0 ; i<num_clients ; i++) {
+        if (clients[i].serial == rep->client) {
+            srv_send(&clients[i], rep->type, rep->payload, rep->len);
+            break;
+        }
+    }
+}
+
+static void srv_drop_client(int idx) {
+    struct dev_request req;
+
+    log_info("client %d disconnected", clients[idx].fd);
+    if (clients[idx].subscribed)
+        num_subscribers--;
+    if (clients[idx].ring_idx >= 0)
+        ring_detach(clients[idx].ring_idx);
+    close(clients[idx].fd);
+    /* nobody is left to answer, forget the client's queued requests */
+    req.client = clients[idx].serial;
+    req.type = RFID_REQ_CANCEL;
+    req.len = 0;
+    clients[idx] = clients[--num_clients];
+    if (io)
+        spsc_push(&io->requests, &req);
+    else if (srv_reader)
+        cmdq_push(srv_reader, &req, srv_deliver_reply);
+}
+
+/* Fan a tag event out to every subscriber. The frame is built once and
+ * sent non-blocking; a subscriber whose socket is full misses the event
+ * rather than stalling the reader. */
+static void srv_publish_tag(const struct rfid_tag_event *tev) {
+    struct rfid_srv_tag_event ev;
+    uint8_t frame[RFID_SRV_HDR_SIZE + sizeof(ev)];
+    int i;
+
+    ev.timestamp_ns = tev->timestamp_ns;
+    ev.reader = tev->reader;
+    ev.attempts = tev->attempts;
+    ev.flags = tev->flags;
+    memcpy(ev.id, tev->id, 5);
+    frame[0] = RFID_EVT_TAG;
+    frame[1] = sizeof(ev);
+    memcpy(&frame[RFID_SRV_HDR_SIZE], &ev, sizeof(ev));
+    for (i=0 ; i<num_clients ; i++) {
+        if (!clients[i].subscribed)
+            continue;
+        if (send(clients[i].fd, frame, sizeof(frame), MSG_DONTWAIT | MSG_NOSIGNAL) < 0
+                && errno != EAGAIN && errno != EWOULDBLOCK)
+            clients[i].subscribed = -1;     /* reaped by the poll loop */
+    }
+}
+
+/* Reply to RFID_REQ_RING_ATTACH, passing the consumer's eventfd along */
+static int srv_send_ring_attach(struct srv_client *c, int efd) {
+    uint8_t frame[RFID_SRV_HDR_SIZE + 1] = {RFID_RSP_RING, 1, c->ring_idx};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { frame, sizeof(frame) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &efd, sizeof(int));
+    return sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void srv_handle_request(struct reader *rd, struct srv_client *c,
+                               uint8_t type, uint8_t *payload, uint8_t len) {
+    struct dev_request req;
+    uint8_t err;
+    int efd;
+
+    switch (type) {
+        case RFID_REQ_READ:
+        case RFID_REQ_BUZZER:
+        case RFID_REQ_WRITE:
+        case RFID_REQ_CANCEL:
+            req.client = c->serial;
+            req.type = type;
+            req.len = len;
+            memcpy(req.payload, payload, len);
+            if (!rd && !io) {
+                /* fleet mode, there is no single reader to address */
+                err = RFID_ERR_UNAVAILABLE;
+                srv_send(c, RFID_RSP_ERROR, &err, 1);
+                break;
+            }
+            if (io) {
+                /* answered from the reply queue */
+                if (spsc_push(&io->requests, &req) < 0) {
+                    err = RFID_ERR_BUSY;
+                    srv_send(c, RFID_RSP_ERROR, &err, 1);
+                }
+                break;
+            }
+            cmdq_push(rd, &req, srv_deliver_reply);
+            break;
+        case RFID_REQ_HANDOVER:
+            if (!rd) {
+                err = RFID_ERR_UNAVAILABLE;
+                srv_send(c, RFID_RSP_ERROR, &err, 1);
+                break;
+            }
+            /* served by run_server once the input is processed */
+            handover_client = c->serial;
+            break;
+        case RFID_REQ_SUBSCRIBE:
+            if (!c->subscribed)
+                num_subscribers++;
+            c->subscribed = 1;
+            srv_send(c, RFID_RSP_OK, NULL, 0);
+            break;
+        case RFID_REQ_UNSUBSCRIBE:
+            if (c->subscribed)
+                num_subscribers--;
+            c->subscribed = 0;
+            srv_send(c, RFID_RSP_OK, NULL, 0);
+            break;
+        case RFID_REQ_RING_ATTACH:
+            if (!ring) {
+                err = RFID_ERR_UNAVAILABLE;
+                srv_send(c, RFID_RSP_ERROR, &err, 1);
+                break;
+            }
+            if (c->ring_idx < 0 && (c->ring_idx = ring_attach(&efd)) < 0) {
+                err = RFID_ERR_BUSY;
+                srv_send(c, RFID_RSP_ERROR, &err, 1);
+                break;
+            }
+            srv_send_ring_attach(c, ring_efd[c->ring_idx]);
+            break;
+        default:
+            err = RFID_ERR_UNKNOWN;
+            srv_send(c, RFID_RSP_ERROR, &err, 1);
+            break;
+    }
+}
+
+/* Read what is available from a client and dispatch every complete
+ * frame. Returns -1 when the client should be dropped. */
+static int srv_client_input(struct reader *rd, struct srv_client *c) {
+    ssize_t n;
+    int len;
+
+    n = recv(c->fd, &c->in_buf[c->in_len], sizeof(c->in_buf) - c->in_len, MSG_DONTWAIT);
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    c->in_len += n;
+
+    while (c->in_len >= RFID_SRV_HDR_SIZE) {
+        len = c->in_buf[1];
+        if (len > RFID_SRV_MAX_PAYLOAD)
+            return -1;
+        if (c->in_len < RFID_SRV_HDR_SIZE + len)
+            break;
+        srv_handle_request(rd, c, c->in_buf[0], &c->in_buf[RFID_SRV_HDR_SIZE], len);
+        c->in_len -= RFID_SRV_HDR_SIZE + len;
+        memmove(c->in_buf, &c->in_buf[RFID_SRV_HDR_SIZE + len], c->in_len);
+    }
+    return 0;
+}
+
+static int print_events = 0;
+
+/* Hand a tag event to every output that is enabled, or print it */
+static void deliver_tag_event(const struct rfid_tag_event *ev) {
+    if (ring)
+        ring_publish(ev);
+    if (num_subscribers)
+        srv_publish_tag(ev);
+    if (!print_events)
+        return;
+    if (workers)
+        fprintf(stdout, "%u ", ev->reader);
+    if (ev->flags & RFID_EVENT_ARRIVED)
+        fprintf(stdout, "ARRIVED ");
+    else if (ev->flags & RFID_EVENT_DEPARTED)
+        fprintf(stdout, "DEPARTED ");
+    fprintf(stdout, "%02X%02X%02X%02X%02X\n",ev->id[0],ev->id[1],ev->id[2],ev->id[3],ev->id[4]);
+}
+
+
+/*
+ * Presence tracking (-p): instead of every read, report ARRIVED once a tag
+ * has been read for the debounce time and DEPARTED once it has not been
+ * read for the hold time. A tag resting on the reader is then one event
+ * instead of hundreds of identical reads.
+ */
+#define PRESENCE_HOLD_MS        300
+#define PRESENCE_DEBOUNCE_MS    0
+
+enum { PRESENCE_EMPTY, PRESENCE_PENDING, PRESENCE_PRESENT };
+
+struct presence {
+    int state;
+    uint8_t id[5];
+    uint64_t first_ns;                  /* first read of this id */
+    uint64_t last_ns;                   /* latest read of this id */
+};
+
+static int presence_enabled = 0;
+static uint64_t presence_hold_ms = PRESENCE_HOLD_MS;
+static uint64_t presence_debounce_ms = PRESENCE_DEBOUNCE_MS;
+static struct presence presence[FLEET_MAX_READERS];
+static uint32_t presence_readers = 0;   /* highest reader id seen + 1 */
+
+static void presence_emit(uint32_t reader, struct presence *p, uint64_t ts, uint8_t flags) {
+    struct rfid_tag_event ev;
+
+    ev.timestamp_ns = ts;
+    ev.reader = reader;
+    ev.attempts = 0;
+    ev.flags = flags;
+    memcpy(ev.id, p->id, 5);
+    deliver_tag_event(&ev);
+}
+
+static void presence_feed(const struct rfid_tag_event *ev) {
+    struct presence *p;
+
+    if (ev->reader >= FLEET_MAX_READERS)
+        return;
+    p = &presence[ev->reader];
+    if (ev->reader >= presence_readers)
+        presence_readers = ev->reader + 1;
+
+    if (p->state != PRESENCE_EMPTY && memcmp(p->id, ev->id, 5)) {
+        /* a different tag replaced the previous one */
+        if (p->state == PRESENCE_PRESENT)
+            presence_emit(ev->reader, p, p->last_ns, RFID_EVENT_DEPARTED);
+        p->state = PRESENCE_EMPTY;
+    }
+    if (p->state == PRESENCE_EMPTY) {
+        p->state = PRESENCE_PENDING;
+        memcpy(p->id, ev->id, 5);
+        p->first_ns = ev->timestamp_ns;
+    }
+    p->last_ns = ev->timestamp_ns;
+    if (p->state == PRESENCE_PENDING
+            && ev->timestamp_ns - p->first_ns >= presence_debounce_ms * 1000000) {
+        p->state = PRESENCE_PRESENT;
+        presence_emit(ev->reader, p, p->first_ns, RFID_EVENT_ARRIVED);
+    }
+}
+
+/* Expire tags not read for the hold time; returns how long until the
+ * next one would expire, -1 if none is tracked */
+static int64_t presence_tick(uint64_t now) {
+    uint64_t hold_ns = presence_hold_ms * 1000000;
+    int64_t wait_ns = -1, left;
+    struct presence *p;
+    uint32_t i;
+
+    for (i=0 ; i<presence_readers ; i++) {
+        p = &presence[i];
+        if (p->state == PRESENCE_EMPTY)
+            continue;
+        if (now >= p->last_ns + hold_ns) {
+            if (p->state == PRESENCE_PRESENT)
+                presence_emit(i, p, p->last_ns, RFID_EVENT_DEPARTED);
+            p->state = PRESENCE_EMPTY;
+            continue;
+        }
+        left = p->last_ns + hold_ns - now;
+        if (wait_ns < 0 || left < wait_ns)
+            wait_ns = left;
     }
-    /* Calculate checksum byte */
-    for (j=1 ; j<i ; j++) {
-        x = x^out_buf[j];
+    return wait_ns;
+}
+
+static void handle_tag_event(const struct rfid_tag_event *ev) {
+    uint64_t start_ns = monotonic_ns();
+
+    if (presence_enabled)
+        presence_feed(ev);
+    else
+        deliver_tag_event(ev);
+    lat_record(LAT_READ, LAT_OUTPUT, monotonic_ns() - start_ns);
+}
+
+/*
+ * Zero downtime upgrade (-R <socket>): a new rfid_reader connects to the
+ * running server and sends RFID_REQ_HANDOVER. The old process stops
+ * polling and passes over that connection, as SCM_RIGHTS, the reader's
+ * device node, its listening socket, every other client connection and
+ * the eventfds of attached ring consumers, followed by the state that
+ * shapes the reader's behaviour and the requests still queued; a write
+ * already under way is finished first. The new process answers RFID_RSP_OK; only
+ * then does the old one release the reader and close the connection, and
+ * the new process adopts the device with libusb_wrap_sys_device once it
+ * sees the close. Clients stay connected.
+ */
+#define HANDOVER_MAGIC          0x564f4448      /* "HDOV" */
+#define HANDOVER_VERSION        2
+#define HANDOVER_MAX_FDS        (2 + SRV_MAX_CLIENTS + RFID_RING_MAX_CONSUMERS)
+#define HANDOVER_ACK_MS         2000    /* new process adopting the fds */
+
+struct handover_client {
+    int subscribed;
+    int ring_idx;
+    int in_len;
+    uint8_t in_buf[RFID_SRV_HDR_SIZE + RFID_SRV_MAX_PAYLOAD];
+};
+
+struct handover {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    int num_clients;
+    uint32_t ring_consumers;
+    struct handover_client client[SRV_MAX_CLIENTS];
+    int num_cmds;
+    struct cmd_item cmd[CMDQ_SLOTS];    /* client: index in client[], deadline: ns left */
+    struct rtt rtt[RTT_CLASSES];
+    struct timing timing;
+    struct health health;
+    struct vote vote;
+    struct poll_rate poll;
+    struct presence presence;
+};
+
+static int handed_over = 0;
+static int srv_listen_fd = -1;          /* listening socket taken over */
+static int dev_fd = -1;                 /* device node behind a wrapped reader */
+static struct handover handover_state;
+
+/* Give the reader, the sockets and the state to the client that asked
+ * for them. The reader is only released once the new process confirmed
+ * it adopted everything; until then the old process keeps it, and on
+ * failure goes back to serving. */
+static int handover_send(struct reader *rd, int lfd) {
+    struct handover *h;
+    struct srv_client *c = NULL;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct ucred cred;
+    struct pollfd pfd;
+    socklen_t len = sizeof(cred);
+    libusb_device *dev;
+    char cbuf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+    uint8_t ack[RFID_SRV_HDR_SIZE];
+    struct dev_request req;
+    struct dev_reply rep;
+    struct cmd_item *it;
+    uint64_t now;
+    int fds[HANDOVER_MAX_FDS];
+    int nfds = 0, node_fd = -1, i, j, r;
+    char node[64];
+    uint8_t err = RFID_ERR_UNAVAILABLE;
+
+    for (i=0 ; i<num_clients ; i++)
+        if (clients[i].serial == handover_client)
+            c = &clients[i];
+    handover_client = 0;
+    if (!c)
+        return -1;
+    if (getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0
+            || (cred.uid != geteuid() && cred.uid != 0)) {
+        srv_send(c, RFID_RSP_ERROR, &err, 1);
+        return -1;
     }
-    out_buf[i] = x;
-    out_buf[i+1] = MESSAGE_END_MARKER;
+    if (dev_fd < 0) {
+        dev = libusb_get_device(rd->devh);
+        snprintf(node, sizeof(node), "/dev/bus/usb/%03d/%03d",
+                 libusb_get_bus_number(dev), libusb_get_device_address(dev));
+        node_fd = open(node, O_RDWR | O_CLOEXEC);
+    }
+    h = calloc(1, sizeof(*h));
+    if ((dev_fd < 0 && node_fd < 0) || !h) {
+        srv_send(c, RFID_RSP_ERROR, &err, 1);
+        if (node_fd >= 0)
+            close(node_fd);
+        free(h);
+        return -1;
+    }
+
+    /* quiesce: no command in flight while the state is copied; what the
+       I/O thread had not taken up yet joins the queue, a started write
+       is run to its end */
+    if (io) {
+        io_pause();
+        while (spsc_pop(&io->requests, &req))
+            cmdq_push(rd, &req, srv_deliver_reply);
+        while (spsc_pop(&io->replies, &rep))
+            srv_deliver_reply(&rep);
+    }
+    cmdq_finish(rd, srv_deliver_reply);
+    cancel_in(rd);
+
+    h->magic = HANDOVER_MAGIC;
+    h->version = HANDOVER_VERSION;
+    h->size = sizeof(*h);
+    memcpy(h->rtt, rd->rtt, sizeof(h->rtt));
+    h->timing = rd->timing;
+    h->health = rd->health;
+    h->vote = rd->vote;
+    h->poll = rd->poll;
+    h->presence = presence[0];
+    now = monotonic_ns();
+    fds[nfds++] = dev_fd >= 0 ? dev_fd : node_fd;
+    fds[nfds++] = lfd;
+    for (i=0 ; i<num_clients ; i++) {
+        if (&clients[i] == c)
+            continue;
+        h->client[h->num_clients].subscribed = clients[i].subscribed;
+        h->client[h->num_clients].ring_idx = clients[i].ring_idx;
+        h->client[h->num_clients].in_len = clients[i].in_len;
+        memcpy(h->client[h->num_clients].in_buf, clients[i].in_buf, clients[i].in_len);
+        for (j=0 ; rd->cmdq && j<rd->cmdq->n ; j++) {
+            /* queued requests move along, keyed by the client's index */
+            if (rd->cmdq->item[j].req.client != clients[i].serial)
+                continue;
+            it = &h->cmd[h->num_cmds++];
+            *it = rd->cmdq->item[j];
+            it->req.client = h->num_clients;
+            it->deadline_ns = it->deadline_ns > now ? it->deadline_ns - now : 0;
+        }
+        h->num_clients++;
+        fds[nfds++] = clients[i].fd;
+    }
+    h->ring_consumers = ring_consumers;
+    for (i=0 ; i<RFID_RING_MAX_CONSUMERS ; i++)
+        if (ring_consumers & (1u << i))
+            fds[nfds++] = ring_efd[i];
 
-    for (i=0 ; i<24 ; i++) {
-        if(i%16 == 0)
-            if (verbose) fprintf(stdout,"\n");
-        if (verbose) fprintf(stdout, "%02x ", out_buf[i]);
+    iov.iov_base = h;
+    iov.iov_len = sizeof(*h);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+    r = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (node_fd >= 0)
+        close(node_fd);
+    free(h);
+
+    /* the new process answers RFID_RSP_OK once it took everything over */
+    if (r == (int)sizeof(*h)) {
+        pfd.fd = c->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, HANDOVER_ACK_MS) != 1
+                || recv(c->fd, ack, sizeof(ack), MSG_WAITALL) != sizeof(ack)
+                || ack[0] != RFID_RSP_OK)
+            r = 0;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    if (r != (int)sizeof(*h)) {
+        log_warn("handover failed: %s, still serving", r < 0 ? strerror(errno) : "not taken");
+        srv_send(c, RFID_RSP_ERROR, &err, 1);
+        arm_in(rd);
+        if (io && io_resume() < 0)
+            running = 0;
+        return -1;
     }
-    if (verbose) fprintf(stdout, "\n");
 
+    /* the new process waits for the connection to close before it
+       claims the reader */
+    close_reader(rd);
+    running = 0;
+    handed_over = 1;
+    log_info("reader handed over, %d clients", num_clients - 1);
+    return 0;
 }
 
-void send_message(struct libusb_device_handle * devh, uint8_t *message, uint8_t *answer) {
-    int r,i;
-    int bt = 0;
+/* New process side: take the reader and the sockets from the server on
+ * `path`. The device fd is left in dev_fd for open_fast. */
+int handover_receive(const char *path) {
+    struct handover *h = &handover_state;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+    int fds[HANDOVER_MAX_FDS];
+    uint8_t req[RFID_SRV_HDR_SIZE] = {RFID_REQ_HANDOVER, 0};
+    uint8_t ack[RFID_SRV_HDR_SIZE] = {RFID_RSP_OK, 0};
+    int fd, nfds = 0, i, n, used;
+    ssize_t r;
 
-    r = libusb_interrupt_transfer(devh, ENDPOINT_IN, answer, 48, &bt, timeout);
-    r = libusb_interrupt_transfer(devh, ENDPOINT_OUT, message, 24, &bt, timeout);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || write(fd, req, sizeof(req)) != sizeof(req)) {
+        fprintf(stderr, "could not reach %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
 
-    if (verbose) fprintf(stdout, "Answer:\n");
-    for (i=0 ; i<48 ; i++) {
-        if(i%16 == 0)
-            if (verbose) fprintf(stdout,"\n");
-        if (verbose) fprintf(stdout, "%02x ", answer[i]);
+    iov.iov_base = h;
+    iov.iov_len = sizeof(*h);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    r = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    for (cmsg = CMSG_FIRSTHDR(&msg) ; r > 0 && cmsg ; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
     }
-    if (verbose) fprintf(stdout, "\n");
+    for (i=0, n=0 ; i<RFID_RING_MAX_CONSUMERS ; i++)
+        n += !!(h->ring_consumers & (1u << i));
+    if (r != (ssize_t)sizeof(*h) || h->magic != HANDOVER_MAGIC
+            || h->version != HANDOVER_VERSION || h->size != sizeof(*h)
+            || h->num_clients < 0 || h->num_clients > SRV_MAX_CLIENTS
+            || h->num_cmds < 0 || h->num_cmds > CMDQ_SLOTS
+            || nfds != 2 + h->num_clients + n) {
+        fprintf(stderr, "%s did not hand the reader over\n", path);
+        for (i=0 ; i<nfds ; i++)
+            close(fds[i]);
+        close(fd);
+        return -1;
+    }
+    /* confirm, then wait for the old process to let go of the reader */
+    if (write(fd, ack, sizeof(ack)) != sizeof(ack)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        for (i=0 ; i<nfds ; i++)
+            close(fds[i]);
+        close(fd);
+        return -1;
+    }
+    while ((r = read(fd, ack, sizeof(ack))) > 0 || (r < 0 && errno == EINTR))
+        ;
+    close(fd);
 
+    dev_fd = fds[0];
+    srv_listen_fd = fds[1];
+    used = 2;
+    for (i=0 ; i<h->num_clients ; i++) {
+        memset(&clients[i], 0, sizeof(clients[0]));
+        clients[i].fd = fds[used++];
+        clients[i].serial = ++client_serial;
+        clients[i].subscribed = h->client[i].subscribed;
+        clients[i].ring_idx = h->client[i].ring_idx;
+        clients[i].in_len = h->client[i].in_len;
+        memcpy(clients[i].in_buf, h->client[i].in_buf, sizeof(clients[i].in_buf));
+        fcntl(clients[i].fd, F_SETFL, fcntl(clients[i].fd, F_GETFL) | O_NONBLOCK);
+        num_subscribers += clients[i].subscribed > 0;
+    }
+    num_clients = h->num_clients;
+    for (i=0 ; i<RFID_RING_MAX_CONSUMERS ; i++)
+        ring_efd[i] = h->ring_consumers & (1u << i) ? fds[used++] : -1;
+    ring_consumers = h->ring_consumers;
+    ring_adopt = 1;
+    return 0;
 }
 
-void handle_interrupt_answer(uint8_t *int_buf, int int_buf_size) {
-    int msg_size = 0;
-    uint8_t cmd = 0;
+/* Carry the old process' view of the reader over */
+void handover_restore(struct reader *rd) {
+    struct handover *h = &handover_state;
+    struct cmd_item *it;
+    uint64_t now;
+    int i;
 
-    if (int_buf_size == 48) {
-        if (verbose) fprintf(stdout,"valid interrupt buffer size found (48)\n");
+    memcpy(rd->rtt, h->rtt, sizeof(rd->rtt));
+    rd->timing = h->timing;
+    rd->health = h->health;
+    /* the old process' probe schedule is on its clock */
+    if (rd->health.next_probe_ns)
+        rd->health.next_probe_ns = monotonic_ns() + HEALTH_PROBE_MS * 1000000ull;
+    rd->vote = h->vote;
+    rd->poll = h->poll;
+    presence[0] = h->presence;
+    if (presence_readers < 1)
+        presence_readers = 1;
 
-        /* parse buffer */
-        if (int_buf[0] != 0x05)
-            fprintf(stdout,"invalid endpoint value %02x!=5\n",int_buf[0]);
+    /* requests the old process had queued, for the clients by their new serial */
+    if (h->num_cmds && !rd->cmdq && !(rd->cmdq = calloc(1, sizeof(*rd->cmdq)))) {
+        log_warn("could not take over %d queued requests", h->num_cmds);
+        return;
+    }
+    now = monotonic_ns();
+    for (i=0 ; i<h->num_cmds ; i++) {
+        if (h->cmd[i].req.client >= (uint32_t)h->num_clients)
+            continue;
+        it = &rd->cmdq->item[rd->cmdq->n++];
+        *it = h->cmd[i];
+        it->req.client = clients[h->cmd[i].req.client].serial;
+        it->deadline_ns += now;
+    }
+}
 
-        if (int_buf[1] != MESSAGE_START_MARKER)
-            fprintf(stdout,"invalid start marker %02x!=0x01\n",int_buf[1]);
+/*
+ * Metrics export (-M <file>): counters and gauges in the Prometheus text
+ * format, written to <file> every METRICS_INTERVAL_MS by the long running
+ * modes and once at exit, for the node_exporter textfile collector. The
+ * file is replaced by a rename, scrapers never see half of it. Summing the
+ * per thread sets only reads them, the polling threads are not stopped.
+ */
+#define METRICS_INTERVAL_MS     5000
 
-        msg_size = int_buf[2];
-        if (msg_size > (48-1))
-            fprintf(stdout,"invalid msg size %d\n", msg_size);
+static const char *metrics_path = NULL;
+static uint64_t metrics_next_ns = 0;
 
-        cmd = int_buf[3];
+static const double metrics_le[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                    0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5};
 
-        /* the checksum on received data is not the same as outgoing data
-        checksum = int_buf[msg_size-1];
-        for (i=0 ; i<5 ; i++)
-            x = x^int_buf[i];
-        if (checksum != x)
-            fprintf(stdout,"checksum missmatch %x!=%x\n",checksum, x);
-        */
+static uint64_t metrics_load(_Atomic uint64_t *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
 
-        if (int_buf[msg_size] != MESSAGE_END_MARKER)
-            fprintf(stdout,"invalid end marker !=0x04\n");
+static void metrics_queue(FILE *f, const char *name, struct spsc_queue *q) {
+    fprintf(f, "rfid_queue_depth{queue=\"%s\"} %u\n", name,
+            atomic_load(&q->head) - atomic_load(&q->tail));
+}
 
-        switch (cmd) {
-            case CMD_EM4100ID_ANSWER:
-                if (msg_size != 0x06)
-                    if (verbose) fprintf(stdout, "%02x%02x%02x%02x%02x\n",int_buf[5],int_buf[6],int_buf[7],int_buf[8],int_buf[9]);
-                break;
-            default:
-                break;
+static void metrics_histograms(FILE *f) {
+    static uint64_t bucket[LAT_BUCKETS];
+    uint64_t count, sum, max, le_ns, cum;
+    int c, st, b, i, n = sizeof(metrics_le) / sizeof(metrics_le[0]);
+
+    fprintf(f, "# HELP rfid_stage_latency_seconds Time per command stage.\n"
+               "# TYPE rfid_stage_latency_seconds histogram\n");
+    for (c=0 ; c<LAT_CLASSES ; c++) {
+        for (st=0 ; st<LAT_STAGES ; st++) {
+            if (!(count = lat_sum(c, st, bucket, &sum, &max)))
+                continue;
+            for (b=0, i=0, cum=0 ; i<n ; i++) {
+                le_ns = metrics_le[i] * 1e9;
+                for ( ; b<LAT_BUCKETS && lat_bucket_max(b) <= le_ns ; b++)
+                    cum += bucket[b];
+                fprintf(f, "rfid_stage_latency_seconds_bucket{class=\"%s\",stage=\"%s\",le=\"%g\"} %llu\n",
+                        lat_class_names[c], lat_stage_names[st], metrics_le[i], (unsigned long long)cum);
+            }
+            fprintf(f, "rfid_stage_latency_seconds_bucket{class=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n"
+                       "rfid_stage_latency_seconds_sum{class=\"%s\",stage=\"%s\"} %.9f\n"
+                       "rfid_stage_latency_seconds_count{class=\"%s\",stage=\"%s\"} %llu\n",
+                    lat_class_names[c], lat_stage_names[st], (unsigned long long)count,
+                    lat_class_names[c], lat_stage_names[st], sum / 1e9,
+                    lat_class_names[c], lat_stage_names[st], (unsigned long long)count);
         }
-    }    
+    }
 }
 
-void interrupt_cb(struct libusb_transfer *xfr){
-    int i;
-    uint8_t* l_answer;
+static void metrics_write(void) {
+    static struct {
+        uint64_t reads, notags, retries;
+        uint64_t transfers[2][METRICS_STATUSES];
+    } sum[METRICS_READERS];
+    static const char *dirs[2] = {"out", "in"};
+    struct metrics_set *ms;
+    struct reader_counters *rc;
+    char tmp[280], name[32];
+    int used[METRICS_READERS];
+    int id, d, st, i, state;
+    FILE *f;
 
-    switch(xfr->status)    {
-        case LIBUSB_TRANSFER_COMPLETED:
-            handle_events-=1;
-            l_answer = xfr->buffer;
-            if (verbose) fprintf(stdout, "interrupt transfer actual_length: %d ", xfr->actual_length);
-            if (xfr->actual_length == 48) {
-                for (i=0 ; i<24 ; i++) {
-                    if(i%16 == 0)
-                        if (verbose) fprintf(stdout,"\n");
-                    if (verbose) fprintf(stdout, "%02x ", answer[i]);
-                }
-                if (verbose) fprintf(stdout, "\n");                
-                handle_interrupt_answer(xfr->buffer, xfr->actual_length);
-                if (verbose) fprintf(stdout, "|%x| \n", (unsigned long)xfr->user_data);
-                if (xfr->user_data)
-                    memcpy(xfr->user_data, l_answer, 48);   //only handle 48 byte answers
-            } 
+    memset(sum, 0, sizeof(sum));
+    for (ms = atomic_load(&metrics_sets) ; ms ; ms = ms->next) {
+        for (id=0 ; id<METRICS_READERS ; id++) {
+            rc = &ms->r[id];
+            sum[id].reads += metrics_load(&rc->reads);
+            sum[id].notags += metrics_load(&rc->notags);
+            sum[id].retries += metrics_load(&rc->retries);
+            for (d=0 ; d<2 ; d++)
+                for (st=0 ; st<METRICS_STATUSES ; st++)
+                    sum[id].transfers[d][st] += metrics_load(&rc->transfers[d][st]);
+        }
+    }
+    /* readers that never did anything are left out */
+    for (id=0 ; id<METRICS_READERS ; id++)
+        used[id] = sum[id].reads || sum[id].notags || sum[id].transfers[0][0]
+            || sum[id].transfers[1][0] || atomic_load(&metrics_gauges[id].state);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+    if (!(f = fopen(tmp, "w"))) {
+        log_warn("metrics %s: %s", tmp, strerror(errno));
+        return;
+    }
+    fprintf(f, "# HELP rfid_reads_total EM4100 reads that found a tag.\n"
+               "# TYPE rfid_reads_total counter\n");
+    for (id=0 ; id<METRICS_READERS ; id++)
+        if (used[id])
+            fprintf(f, "rfid_reads_total{reader=\"%d\"} %llu\n", id, (unsigned long long)sum[id].reads);
+    fprintf(f, "# HELP rfid_notags_total EM4100 reads that gave up without a tag.\n"
+               "# TYPE rfid_notags_total counter\n");
+    for (id=0 ; id<METRICS_READERS ; id++)
+        if (used[id])
+            fprintf(f, "rfid_notags_total{reader=\"%d\"} %llu\n", id, (unsigned long long)sum[id].notags);
+    fprintf(f, "# HELP rfid_read_retries_total Read round trips past the first one.\n"
+               "# TYPE rfid_read_retries_total counter\n");
+    for (id=0 ; id<METRICS_READERS ; id++)
+        if (used[id])
+            fprintf(f, "rfid_read_retries_total{reader=\"%d\"} %llu\n", id, (unsigned long long)sum[id].retries);
+    fprintf(f, "# HELP rfid_transfers_total USB transfers by endpoint and completion status.\n"
+               "# TYPE rfid_transfers_total counter\n");
+    for (id=0 ; id<METRICS_READERS ; id++)
+        for (d=0 ; used[id] && d<2 ; d++)
+            for (st=0 ; st<METRICS_STATUSES ; st++)
+                if (sum[id].transfers[d][st] || st == LIBUSB_TRANSFER_COMPLETED)
+                    fprintf(f, "rfid_transfers_total{reader=\"%d\",endpoint=\"%s\",status=\"%s\"} %llu\n",
+                            id, dirs[d], transfer_status_names[st],
+                            (unsigned long long)sum[id].transfers[d][st]);
+    fprintf(f, "# HELP rfid_reader_up Whether the reader is open and not dead.\n"
+               "# TYPE rfid_reader_up gauge\n");
+    for (id=0 ; id<METRICS_READERS ; id++) {
+        state = atomic_load(&metrics_gauges[id].state);
+        if (used[id])
+            fprintf(f, "rfid_reader_up{reader=\"%d\"} %d\n", id, state && state != READER_DEAD + 1);
+    }
+    fprintf(f, "# HELP rfid_reader_health Reader health, 0 ok, 1 degraded, 2 dead, -1 closed.\n"
+               "# TYPE rfid_reader_health gauge\n");
+    for (id=0 ; id<METRICS_READERS ; id++)
+        if (used[id])
+            fprintf(f, "rfid_reader_health{reader=\"%d\"} %d\n", id,
+                    atomic_load(&metrics_gauges[id].state) - 1);
+    fprintf(f, "# HELP rfid_command_queue_depth Device requests queued for the reader.\n"
+               "# TYPE rfid_command_queue_depth gauge\n");
+    for (id=0 ; id<METRICS_READERS ; id++)
+        if (used[id])
+            fprintf(f, "rfid_command_queue_depth{reader=\"%d\"} %d\n", id,
+                    atomic_load(&metrics_gauges[id].queued));
+    if (io || workers)
+        fprintf(f, "# HELP rfid_queue_depth Entries in the queues between threads.\n"
+                   "# TYPE rfid_queue_depth gauge\n");
+    if (io) {
+        metrics_queue(f, "io_requests", &io->requests);
+        metrics_queue(f, "io_replies", &io->replies);
+        for (i=0 ; i<io->num_consumers ; i++) {
+            snprintf(name, sizeof(name), "io_events_%d", i);
+            metrics_queue(f, name, &io->events[i]);
+        }
+    }
+    for (i=0 ; workers && i<num_workers ; i++) {
+        snprintf(name, sizeof(name), "worker_%d_commands", i);
+        metrics_queue(f, name, &workers[i].cmds);
+        snprintf(name, sizeof(name), "worker_%d_events", i);
+        metrics_queue(f, name, &workers[i].events);
+    }
+    metrics_histograms(f);
+    if (fclose(f) != 0 || rename(tmp, metrics_path) < 0) {
+        log_warn("metrics %s: %s", metrics_path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* Write the metrics if they are due; returns the wait until the next write */
+static int64_t metrics_tick(uint64_t now) {
+    if (now >= metrics_next_ns) {
+        metrics_write();
+        metrics_next_ns = now + METRICS_INTERVAL_MS * 1000000ull;
+    }
+    return metrics_next_ns - now;
+}
+
+/* Serve clients on `path` and/or publish to the -P ring. Without a socket
+ * path the loop only polls the reader for the ring. In threaded and fleet
+ * mode the reads come from the I/O or worker threads (rd is NULL for a
+ * fleet), and without any output they are printed. */
+int run_server(struct reader *rd, const char *path) {
+    struct sockaddr_un addr;
+    struct pollfd pfds[SRV_MAX_CLIENTS + 2];
+    struct rfid_tag_event ev;
+    struct dev_reply rep;
+    struct spsc_queue *sources[FLEET_MAX_WORKERS];
+    int num_sources = 0;
+    struct merge merge;
+    struct waker waker;
+    struct timespec tmo;
+    int64_t wait_ns, scan_ns;
+    uint64_t now;
+    int attempts, pending, polling;
+    int lfd = -1, fd, i;
+    const char *bound = path;
+
+    srv_reader = io ? NULL : rd;
+    health_watch = 1;
+    if (path && srv_listen_fd >= 0) {
+        /* taken over from the previous process, already bound */
+        lfd = srv_listen_fd;
+        fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+        srv_listen_fd = -1;
+        path = NULL;
+    }
+    if (path)
+        lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (path && lfd < 0) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (path) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 8) < 0) {
+            fprintf(stderr, "bind %s: %s\n", path, strerror(errno));
+            close(lfd);
+            return -1;
+        }
+        log_info("serving on %s", path);
+    }
+    /* clients can connect while the firmware is probed; a reader taken
+       over keeps what the old process learned */
+    if (rd && !io && !rd->health.next_probe_ns)
+        reader_probe(rd);
+
+    if (io || workers) {
+        if (waker_init(&waker) < 0) {
+            fprintf(stderr, "could not set up threaded mode\n");
+            goto done;
+        }
+    }
+    if (io) {
+        if (!(sources[0] = io_add_consumer(&waker)) || io_start() < 0) {
+            fprintf(stderr, "could not set up threaded mode\n");
+            goto done;
+        }
+        num_sources = 1;
+    }
+    if (workers) {
+        if (fleet_start(&waker) < 0)
+            goto done;
+        for (i=0 ; i<num_workers ; i++)
+            sources[num_sources++] = &workers[i].events;
+        fleet_scan();
+    }
+    merge_init(&merge, sources, num_sources, merge_window_us);
+    print_events = !path && !ring;
+
+    while (running) {
+        if (lat_report_requested) {
+            lat_report_requested = 0;
+            lat_report();
+        }
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = num_sources ? waker.efd : -1;
+        pfds[1].events = POLLIN;
+        for (i=0 ; i<num_clients ; i++) {
+            pfds[i+2].fd = clients[i].fd;
+            pfds[i+2].events = POLLIN;
+        }
+        /* keep the reader busy while anybody listens, otherwise sleep */
+        polling = num_subscribers || ring || print_events;
+        wait_ns = polling ? 0 : -1;
+        if (rd && !io && polling) {
+            now = monotonic_ns();
+            wait_ns = poll_wait_ns(rd, now);
+            scan_ns = presence_enabled ? presence_tick(now) : -1;
+            if (scan_ns >= 0 && scan_ns < wait_ns)
+                wait_ns = scan_ns;
+        }
+        if (rd && !io) {
+            scan_ns = health_wait_ns(rd, monotonic_ns());
+            if (scan_ns >= 0 && (wait_ns < 0 || scan_ns < wait_ns))
+                wait_ns = scan_ns;
+            if (cmdq_ready(rd, monotonic_ns(), polling))
+                wait_ns = 0;
+        }
+        if (num_sources) {
+            now = monotonic_ns();
+            wait_ns = merge_wait_ns(&merge, now);
+            if (workers) {
+                scan_ns = fleet_scan_wait_ns(now);
+                if (wait_ns < 0 || scan_ns < wait_ns)
+                    wait_ns = scan_ns;
+            }
+            if (presence_enabled) {
+                scan_ns = presence_tick(now);
+                if (scan_ns >= 0 && (wait_ns < 0 || scan_ns < wait_ns))
+                    wait_ns = scan_ns;
+            }
+            atomic_store(&waker.waiting, 1);
+            pending = io && !spsc_empty(&io->replies);
+            for (i=0 ; i<num_sources ; i++)
+                pending |= !spsc_empty(sources[i]);
+            if (pending)
+                wait_ns = 0;
+        }
+        if (metrics_path) {
+            scan_ns = metrics_tick(monotonic_ns());
+            if (wait_ns < 0 || scan_ns < wait_ns)
+                wait_ns = scan_ns;
+        }
+        tmo.tv_sec = wait_ns / 1000000000;
+        tmo.tv_nsec = wait_ns % 1000000000;
+        if (ppoll(pfds, num_clients + 2, wait_ns < 0 ? NULL : &tmo, NULL) < 0 && errno != EINTR)
             break;
-        case LIBUSB_TRANSFER_CANCELLED:
-        case LIBUSB_TRANSFER_NO_DEVICE:
-        case LIBUSB_TRANSFER_TIMED_OUT:
-        case LIBUSB_TRANSFER_ERROR:
-        case LIBUSB_TRANSFER_STALL:
-        case LIBUSB_TRANSFER_OVERFLOW:
-            if (verbose) fprintf(stdout, "transfer error\n");
-            handle_events = 0;
+
+        if (num_sources) {
+            atomic_store(&waker.waiting, 0);
+            if (pfds[1].revents & POLLIN)
+                waker_clear(&waker);
+            while (io && spsc_pop(&io->replies, &rep))
+                srv_deliver_reply(&rep);
+            now = monotonic_ns();
+            while (merge_next(&merge, now, &ev)) {
+                if (ev.flags & EV_READER_LOST)
+                    fleet_reader_lost(ev.reader);
+                else
+                    handle_tag_event(&ev);
+            }
+            if (workers && fleet_scan_wait_ns(now) == 0)
+                fleet_scan();
+        }
+
+        for (i=num_clients-1 ; i>=0 ; i--) {
+            if (clients[i].subscribed < 0
+                    || (pfds[i+2].revents & (POLLIN | POLLHUP | POLLERR)
+                        && srv_client_input(rd, &clients[i]) < 0))
+                srv_drop_client(i);
+        }
+        if (handover_client && handover_send(rd, lfd) == 0)
             break;
+
+        if (pfds[0].revents & POLLIN) {
+            while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                if (num_clients == SRV_MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                memset(&clients[num_clients], 0, sizeof(clients[0]));
+                clients[num_clients].ring_idx = -1;
+                clients[num_clients].serial = ++client_serial;
+                clients[num_clients++].fd = fd;
+                log_info("client %d connected", fd);
+            }
+        }
+
+        /* inline mode: a health probe, a queued command or a poll per turn */
+        polling = num_subscribers || ring || print_events;
+        if (rd && !io && health_wait_ns(rd, monotonic_ns()) == 0) {
+            health_probe(rd);
+        } else if (rd && !io && cmdq_ready(rd, monotonic_ns(), polling)) {
+            cmdq_run(rd, srv_deliver_reply);
+        } else if (rd && !io && polling && poll_wait_ns(rd, monotonic_ns()) == 0) {
+            cmdq_polled(rd);
+            if (read_em4100id(rd, ev.id, 1, &attempts) == 0) {
+                ev.timestamp_ns = rd->answer_ns;
+                ev.reader = 0;
+                ev.attempts = attempts;
+                ev.flags = 0;
+                handle_tag_event(&ev);
+            }
+        }
+        if (rd && !io && presence_enabled)
+            presence_tick(monotonic_ns());
+    }
+
+done:
+    if (io)
+        io_stop();
+    if (workers)
+        fleet_stop();
+    if (io || workers)
+        close(waker.efd);
+    if (handed_over) {
+        /* the new process owns the sockets now, only drop our copies */
+        for (i=0 ; i<num_clients ; i++)
+            close(clients[i].fd);
+        num_clients = 0;
     }
+    for (i=num_clients-1 ; i>=0 ; i--)
+        srv_drop_client(i);
+    srv_reader = NULL;
+    if (lfd >= 0)
+        close(lfd);
+    if (bound && !handed_over)
+        unlink(bound);
+    return 0;
 }
 
-void init_protocol(struct libusb_device_handle * devh) {
+/*
+ * Fast open: a reader named by -d (or remembered by -u) is opened through
+ * its device node and handed to libusb_wrap_sys_device, so neither the
+ * device list nor any other device's descriptor is read. libusb_init
+ * still scans the bus: LIBUSB_OPTION_WEAK_AUTHORITY would skip that, but
+ * the reopen step of fault recovery needs the device list.
+ */
+static int fast_fd = -1;                /* device node we opened */
 
-    // the protocol needs a previous sent interrupt in request
-    // and it should not be handled
-    // most likely to sync the device buffer somehow
-    uint8_t* message;
-    struct libusb_transfer *xfr_in;
-    message = calloc(1, 48);
-    xfr_in = libusb_alloc_transfer(0);
-    libusb_fill_interrupt_transfer(xfr_in, devh, ENDPOINT_IN, message, 48, interrupt_cb, answer, 0);
+static int sysfs_read_int(const char *dev, const char *attr) {
+    char name[128];
+    FILE *f;
+    int v = -1;
 
-    if(libusb_submit_transfer(xfr_in) < 0)
-        libusb_free_transfer(xfr_in);
-    else
-        if (verbose) fprintf(stdout, "init succeeded\n");
+    snprintf(name, sizeof(name), "/sys/bus/usb/devices/%s/%s", dev, attr);
+    if ((f = fopen(name, "r"))) {
+        if (fscanf(f, "%d", &v) != 1)
+            v = -1;
+        fclose(f);
+    }
+    return v;
+}
 
-    //usleep(500 *1000);
-    
+int open_fast(const char *dev, libusb_device_handle **devh) {
+    struct libusb_device_descriptor desc;
+    char node[64];
+    int fd, bus, addr;
+
+    if (!strncmp(dev, "fd:", 3)) {
+        fd = atoi(&dev[3]);
+    } else if (dev[0] == '/') {
+        fd = fast_fd = open(dev, O_RDWR | O_CLOEXEC);
+    } else {
+        bus = sysfs_read_int(dev, "busnum");
+        addr = sysfs_read_int(dev, "devnum");
+        if (bus < 0 || addr < 0)
+            return -1;
+        snprintf(node, sizeof(node), "/dev/bus/usb/%03d/%03d", bus, addr);
+        fd = fast_fd = open(node, O_RDWR | O_CLOEXEC);
+    }
+    if (fd < 0 || libusb_wrap_sys_device(NULL, (intptr_t)fd, devh) < 0)
+        goto fail;
+    dev_fd = fd;
+    /* the path may have been taken by another device since it was cached */
+    if (libusb_get_device_descriptor(libusb_get_device(*devh), &desc) < 0
+            || desc.idVendor != VENDOR_ID || desc.idProduct != PRODUCT_ID) {
+        libusb_close(*devh);
+        *devh = NULL;
+        dev_fd = -1;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (fast_fd >= 0)
+        close(fast_fd);
+    fast_fd = -1;
+    return -1;
+}
+
+static char *path_cache_load(const char *file) {
+    static char path[32];
+    FILE *f;
+    int ok;
+
+    if (!(f = fopen(file, "r")))
+        return NULL;
+    ok = fscanf(f, "%31s", path) == 1;
+    fclose(f);
+    return ok ? path : NULL;
 }
 
-void uninit_protocol(void) {
-    if (verbose) fprintf(stdout, "uninit_protocol\n");
-    while(handle_events) {
-        if(libusb_handle_events(NULL) != LIBUSB_SUCCESS) break;
-        if (verbose) fprintf(stdout, "loop uninit\n");
+static void path_cache_save(const char *file, libusb_device *dev) {
+    char path[32];
+    FILE *f;
+
+    usb_path_string(dev, path, sizeof(path));
+    if (!(f = fopen(file, "w"))) {
+        fprintf(stderr, "could not write %s: %s\n", file, strerror(errno));
+        return;
     }
+    fprintf(f, "%s\n", path);
+    fclose(f);
 }
 
-void send_message_async(struct libusb_device_handle * devh, uint8_t *message, uint8_t *answer) {		
-    struct libusb_transfer *xfr_out, *xfr_in;
-    uint8_t* usb_msg_out = malloc(24);
-    uint8_t* usb_msg_in = calloc(1, 48);
+/*
+ * Fault recovery ladder, run by send_message_async after a failed round
+ * trip: a STALL gets its halt cleared, a timeout is simply sent again,
+ * errors that keep coming get a port reset and a reader that went away
+ * is looked up again (same USB path first) and reopened. Each step is
+ * counted, timed and credited when the command then goes through.
+ */
 
-    xfr_out = libusb_alloc_transfer(0);
-    xfr_in = libusb_alloc_transfer(0);
+static void recover_begin(struct reader *rd, int step, uint64_t *t0) {
+    rd->recover.step[step].attempts++;
+    rd->recover.last_step = step;
+    *t0 = monotonic_ns();
+}
 
-    memcpy(usb_msg_out, message, 24);
-    libusb_fill_interrupt_transfer(xfr_out, devh, ENDPOINT_OUT, usb_msg_out, 24, interrupt_cb, NULL, timeout);
-    libusb_fill_interrupt_transfer(xfr_in, devh, ENDPOINT_IN, usb_msg_in, 48, interrupt_cb, answer, 0);
+static void recover_end(struct reader *rd, int step, uint64_t t0) {
+    struct recover_step *st = &rd->recover.step[step];
+    uint64_t t = monotonic_ns() - t0;
 
-    if(libusb_submit_transfer(xfr_out) < 0)
-        libusb_free_transfer(xfr_out);
-    handle_events = 2;
-    //usleep(50 * 1000);
+    st->time_ns += t;
+    if (t > st->max_ns)
+        st->max_ns = t;
+}
+
+/* Find the reader again after it was lost and claim it in place of the
+ * old handle; scans are spaced out with a growing backoff */
+static int recover_reopen(struct reader *rd) {
+    struct recovery *rc = &rd->recover;
+    struct libusb_device_descriptor desc;
+    libusb_device_handle *devh = NULL;
+    libusb_device **devs;
+    char path[32];
+    uint64_t now = monotonic_ns(), t0;
+    struct timespec ts;
+    ssize_t n, i;
+    int pass, r;
 
-    while(handle_events) {
-        if(libusb_handle_events(NULL) != LIBUSB_SUCCESS) break;
-        if (verbose) fprintf(stdout, "event %d handled\n", handle_events);
+    if (now < rc->next_reopen_ns) {
+        ts.tv_sec = (rc->next_reopen_ns - now) / 1000000000;
+        ts.tv_nsec = (rc->next_reopen_ns - now) % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+    recover_begin(rd, RECOVER_REOPEN, &t0);
+    n = libusb_get_device_list(rd->ctx, &devs);
+    /* the same port first, then any reader (replugged elsewhere) */
+    for (pass=0 ; pass<2 && !devh ; pass++) {
+        for (i=0 ; i<n && !devh ; i++) {
+            if (libusb_get_device_descriptor(devs[i], &desc) < 0
+                    || desc.idVendor != VENDOR_ID || desc.idProduct != PRODUCT_ID)
+                continue;
+            usb_path_string(devs[i], path, sizeof(path));
+            if ((pass || !strcmp(path, rc->path)) && libusb_open(devs[i], &devh) < 0)
+                devh = NULL;
+        }
+    }
+    if (n >= 0)
+        libusb_free_device_list(devs, 1);
+    if (devh) {
+        r = libusb_detach_kernel_driver(devh, 0);
+        if ((r < 0 && r != LIBUSB_ERROR_NOT_FOUND && r != LIBUSB_ERROR_NOT_SUPPORTED)
+                || libusb_claim_interface(devh, 0) < 0) {
+            libusb_close(devh);
+            devh = NULL;
+        }
+    }
+    if (!devh) {
+        rc->reopen_ms = rc->reopen_ms ? rc->reopen_ms * 2 : RECOVER_REOPEN_MIN_MS;
+        if (rc->reopen_ms > RECOVER_REOPEN_MAX_MS)
+            rc->reopen_ms = RECOVER_REOPEN_MAX_MS;
+        rc->next_reopen_ns = monotonic_ns() + rc->reopen_ms * 1000000ull;
+        recover_end(rd, RECOVER_REOPEN, t0);
+        return -1;
     }
 
-    //usleep(100 * 1000);
+    cancel_in(rd);
+    libusb_close(rd->devh);
+    /* a wrapped node belonged to the old device */
+    if (dev_fd >= 0) {
+        close(dev_fd);
+        if (fast_fd == dev_fd)
+            fast_fd = -1;
+        dev_fd = -1;
+    }
+    rd->devh = devh;
+    usb_path_string(libusb_get_device(devh), rc->path, sizeof(rc->path));
+    rc->reopen_ms = 0;
+    rc->next_reopen_ns = 0;
+    init_protocol(rd);
+    recover_end(rd, RECOVER_REOPEN, t0);
+    log_info("reader %u: reopened at %s", rd->id, rc->path);
+    return 0;
+}
 
-    handle_events = 1;
-    if(libusb_submit_transfer(xfr_in) < 0)
-        libusb_free_transfer(xfr_in);
+/* Returns 1 when the failed command should be sent again */
+int reader_recover(struct reader *rd, int tries) {
+    struct recovery *rc = &rd->recover;
+    int status = rd->last_status;
+    int resend = 0, step = -1, r;
+    uint64_t t0;
 
-    //usleep(50 * 1000);    
+    rc->errors++;
+    log_debug("reader %u: round trip failed (%d), %d in a row",
+              rd->id, status, rc->errors);
+    if (status == LIBUSB_TRANSFER_NO_DEVICE) {
+        cancel_in(rd);
+        return rc->path[0] && recover_reopen(rd) == 0 && tries < RECOVER_RESENDS;
+    }
+
+    if (rc->errors >= RECOVER_RESET_ERRORS) {
+        cancel_in(rd);
+        recover_begin(rd, RECOVER_RESET, &t0);
+        r = libusb_reset_device(rd->devh);
+        recover_end(rd, RECOVER_RESET, t0);
+        rc->errors = 0;
+        log_debug("reader %u: port reset: %s", rd->id, r ? libusb_error_name(r) : "ok");
+        /* re-enumerated under a new address: the handle is gone */
+        if (r == LIBUSB_ERROR_NOT_FOUND || r == LIBUSB_ERROR_NO_DEVICE)
+            return rc->path[0] && recover_reopen(rd) == 0 && tries < RECOVER_RESENDS;
+        resend = r == 0;
+    } else if (status == LIBUSB_TRANSFER_STALL) {
+        /* libusb wants the endpoint idle before the halt is cleared */
+        cancel_in(rd);
+        recover_begin(rd, RECOVER_CLEAR_HALT, &t0);
+        resend = libusb_clear_halt(rd->devh, rc->stall_ep) == 0;
+        recover_end(rd, RECOVER_CLEAR_HALT, t0);
+    } else if (status == LIBUSB_TRANSFER_TIMED_OUT) {
+        /* the drain is part of it: a late answer must not be taken
+           for the resent command's */
+        step = RECOVER_RESUBMIT;
+        recover_begin(rd, step, &t0);
+        resend = 1;
+    }
+    /* ERROR and OVERFLOW: drop what is queued and let the caller retry */
+    drain_reports(rd);
+    if (step >= 0)
+        recover_end(rd, step, t0);
+    return resend && tries < RECOVER_RESENDS;
 }
 
+#ifdef RFID_SIM
+/*
+ * Fault benchmark (-B <reads>, rfid_reader_sim only): <reads> EM4100 reads
+ * the way -r does them, for every fault kind of sim_usb.h at increasing
+ * rates, on the virtual clock. Reports goodput (reads returning the id of
+ * the tag in the field per simulated second), wrong ids, latency
+ * percentiles and round trips per read.
+ */
+static const double bench_rates[] = {0.001, 0.01, 0.05, 0.1, 0.2};
 
-void send_read_em4100id(struct libusb_device_handle * devh) {
-    uint8_t cmd[24] = {0};
-    int cmd_answer_size = 0;
-    int retry_cnt = 10;   // flaky read, retry 10 times
-    
-    while ((cmd_answer_size < 5) && retry_cnt) {
-        prepare_message(cmd, ENDPOINT_OUT, CMD_EM4100ID_READ, NULL, 0);
-        send_message_async(devh, cmd, answer);
-        handle_interrupt_answer(answer, 48);
-        cmd_answer_size = answer[2] - MESSAGE_STRUCTURE_SIZE - 1;
-        retry_cnt--;
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_row(struct reader *rd, const char *fault, double rate, int reads,
+                      const uint8_t *want, uint64_t *lat) {
+    uint8_t id[5];
+    uint64_t start_ns, t;
+    int i, attempts, rounds = 0, ok = 0, wrong = 0;
+
+    /* every row starts from a fresh reader state */
+    memset(rd->rtt, 0, sizeof(rd->rtt));
+    rd->recover.errors = 0;
+    memset(rd->recover.step, 0, sizeof(rd->recover.step));
+    rd->health.misses = 0;
+    start_ns = monotonic_ns();
+    for (i=0 ; i<reads ; i++) {
+        t = monotonic_ns();
+        if (read_em4100id(rd, id, READ_RETRIES, &attempts) == 0) {
+            if (memcmp(id, want, 5))
+                wrong++;
+            else
+                ok++;
+        }
+        rounds += attempts;
+        lat[i] = monotonic_ns() - t;
     }
-    if (cmd_answer_size < 5)
-        fprintf(stdout, "NOTAG\n");
-    else
-        fprintf(stdout, "%02X%02X%02X%02X%02X\n",answer[5],answer[6],answer[7],answer[8],answer[9]);
+    t = monotonic_ns() - start_ns;
+    qsort(lat, reads, sizeof(*lat), bench_cmp);
+    fprintf(stdout, "%-9s %6.3f %10.1f %6.2f%% %6d %9.2f %9.2f %9.2f %9.2f %7.2f\n",
+            fault, rate, ok / (t / 1e9), 100.0 * ok / reads, wrong,
+            lat[reads / 2] / 1e6, lat[reads * 99 / 100] / 1e6, lat[reads * 999 / 1000] / 1e6,
+            lat[reads - 1] / 1e6, (double)rounds / reads);
 }
 
+void sim_bench(struct reader *rd, int reads) {
+    uint64_t *lat = malloc(reads * sizeof(*lat));
+    uint8_t want[5];
+    int f, r;
 
-void send_buzzer(struct libusb_device_handle * devh) {
-    uint8_t cmd[48] = {0};
-    uint8_t answer[48] = {0};
-    uint8_t duration = 9;
-    prepare_message(cmd, ENDPOINT_OUT, CMD_BUZZER, &duration, 1);
-    send_message_async(devh, cmd, answer);
+    if (read_em4100id(rd, want, READ_RETRIES, NULL) < 0) {
+        fprintf(stderr, "no tag in the simulated field\n");
+        free(lat);
+        return;
+    }
+    fprintf(stdout, "%-9s %6s %10s %7s %6s %9s %9s %9s %9s %7s\n", "fault", "rate", "goodput/s",
+            "ok", "wrong", "p50 ms", "p99 ms", "p99.9 ms", "max ms", "rounds");
+    bench_row(rd, "none", 0, reads, want, lat);
+    for (f=0 ; f<SIM_FAULTS ; f++) {
+        for (r=0 ; r<(int)(sizeof(bench_rates) / sizeof(bench_rates[0])) ; r++) {
+            sim_set_fault(f, bench_rates[r]);
+            bench_row(rd, sim_fault_names[f], bench_rates[r], reads, want, lat);
+        }
+        sim_set_fault(f, 0);
+    }
+    free(lat);
+}
+
+/*
+ * Scale test (-N <workers> -L <readers,...>, rfid_reader_sim only): for
+ * every scale point as many simulated readers are plugged in and polled
+ * by the fleet at full rate. Once every reader delivered a tag event the
+ * point is measured for SCALE_RUN_MS: reads per second, CPU time per read
+ * (all threads, simulation included), resident memory per reader and the
+ * latency from the IN completion to the event leaving the merge stage.
+ */
+#define SCALE_RUN_MS        3000
+#define SCALE_ATTACH_MS     20000
+#define SCALE_SAMPLES       (1 << 20)
+
+static uint64_t rusage_ns(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static uint64_t rss_bytes(void) {
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static int scale_point(int readers, int nworkers, uint64_t *lat) {
+    struct spsc_queue *sources[FLEET_MAX_WORKERS];
+    struct rfid_tag_event ev;
+    struct merge merge;
+    struct waker waker;
+    struct pollfd pfd;
+    struct timespec tmo;
+    uint8_t seen[FLEET_MAX_READERS] = {0};
+    uint64_t rss0, cpu0 = 0, now, start_ns = 0, end_ns, n = 0, reads = 0, lost = 0, dropped = 0;
+    int64_t wait_ns;
+    int i, waiting;
+
+    readers = sim_set_readers(readers);
+    waiting = readers;
+    fleet_size = 0;
+    rss0 = rss_bytes();
+    if (fleet_init(nworkers) < 0 || waker_init(&waker) < 0) {
+        fprintf(stderr, "could not set up %d fleet workers\n", nworkers);
+        return -1;
+    }
+    if (fleet_start(&waker) < 0) {
+        fleet_stop();
+        close(waker.efd);
+        return -1;
+    }
+    for (i=0 ; i<num_workers ; i++)
+        sources[i] = &workers[i].events;
+    merge_init(&merge, sources, num_workers, merge_window_us);
+    fleet_scan();
+
+    end_ns = monotonic_ns() + SCALE_ATTACH_MS * 1000000ull;
+    while (running && (now = monotonic_ns()) < end_ns) {
+        wait_ns = merge_wait_ns(&merge, now);
+        if (wait_ns < 0 || (uint64_t)wait_ns > end_ns - now)
+            wait_ns = end_ns - now;
+        atomic_store(&waker.waiting, 1);
+        for (i=0 ; i<num_workers ; i++)
+            if (!spsc_empty(sources[i]))
+                wait_ns = 0;
+        pfd.fd = waker.efd;
+        pfd.events = POLLIN;
+        tmo.tv_sec = wait_ns / 1000000000;
+        tmo.tv_nsec = wait_ns % 1000000000;
+        ppoll(&pfd, 1, &tmo, NULL);
+        atomic_store(&waker.waiting, 0);
+        if (pfd.revents & POLLIN)
+            waker_clear(&waker);
+        now = monotonic_ns();
+        while (merge_next(&merge, now, &ev)) {
+            if (ev.flags & EV_READER_LOST) {
+                fleet_reader_lost(ev.reader);
+                lost++;
+            } else if (waiting) {
+                if (ev.reader < FLEET_MAX_READERS && !seen[ev.reader]++)
+                    waiting--;
+            } else {
+                if (n < SCALE_SAMPLES)
+                    lat[n++] = now - ev.timestamp_ns;
+                reads++;
+            }
+        }
+        if (fleet_scan_wait_ns(now) == 0)
+            fleet_scan();
+        if (!waiting && !start_ns) {
+            /* all attached and answering, measure from here */
+            start_ns = now;
+            end_ns = now + SCALE_RUN_MS * 1000000ull;
+            cpu0 = rusage_ns();
+        }
+    }
+    now = monotonic_ns();
+    cpu0 = rusage_ns() - cpu0;
+    rss0 = rss_bytes() - rss0;
+    for (i=0 ; i<num_workers ; i++)
+        dropped += workers[i].events.dropped;
+    fleet_stop();
+    close(waker.efd);
+    if (!start_ns) {
+        fprintf(stderr, "%d readers: only %d attached in %d ms\n", readers, readers - waiting,
+                SCALE_ATTACH_MS);
+        return -1;
+    }
+
+    qsort(lat, n, sizeof(*lat), bench_cmp);
+    fprintf(stdout, "%7d %7d %9.0f %9.1f %9.1f %8.2f %8.2f %8.2f %8llu %6llu\n",
+            readers, nworkers, reads / ((now - start_ns) / 1e9), reads ? cpu0 / 1e3 / reads : 0,
+            rss0 / 1024.0 / readers, n ? lat[n / 2] / 1e6 : 0, n ? lat[n * 99 / 100] / 1e6 : 0,
+            n ? lat[n - 1] / 1e6 : 0, (unsigned long long)dropped, (unsigned long long)lost);
+    return 0;
+}
+
+void sim_scale(const char *points, int nworkers) {
+    /* touched up front so that the samples do not count as reader memory */
+    uint64_t *lat = malloc(SCALE_SAMPLES * sizeof(*lat));
+    char *list = strdup(points), *tok, *save;
+
+    if (!sim_realtime()) {
+        fprintf(stderr, "the scale test runs threads, it needs RFID_SIM=clock=real\n");
+        goto out;
+    }
+    memset(lat, 0, SCALE_SAMPLES * sizeof(*lat));
+    fprintf(stdout, "%7s %7s %9s %9s %9s %8s %8s %8s %8s %6s\n", "readers", "workers", "reads/s",
+            "cpu us/rd", "KB/reader", "p50 ms", "p99 ms", "max ms", "dropped", "lost");
+    for (tok = strtok_r(list, ",", &save) ; tok && running ; tok = strtok_r(NULL, ",", &save)) {
+        if (scale_point(atoi(tok), nworkers, lat) < 0)
+            break;
+        /* fleet_stop() ends the workers through `running` */
+        running = 1;
+    }
+out:
+    free(list);
+    free(lat);
+}
+#endif
+
+static void stop_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+void print_usage(void) {
+    fprintf(stderr,
+        "usage: rfid_reader [-v] [-r] [-b] [-w <10 hex digits> -f <format>] [-S <socket>] [-P <ring>] [-T [-C <cpu>]] [-N <workers> [-W <us>]]\n"
+        "                   [-p [-H <ms>] [-D <ms>]] [-K <k/n>] [-A <ms>] [-t <file> [-c]]\n"
+        "                   [-d <dev> | -u <file> | -R <socket>] [-F <file>] [-X <file>] [-O <file>]\n"
+        "  -v          debug logging (compiled out by make LOG_MAX=2)\n"
+        "  -r          read an EM4100 id\n"
+        "  -b          sound the buzzer\n"
+        "  -w <id>     write an EM4100 id to a writable tag\n"
+        "  -f <n>      tag format for -w: 1 T5577, 2 EM4305\n"
+        "  -S <path>   serve the reader to local clients on a Unix socket\n"
+        "  -P <name>   publish tag events to the shared memory ring /dev/shm/<name>\n"
+        "  -T          poll the reader from a dedicated I/O thread (prints ids without -S/-P)\n"
+        "  -C <cpu>    pin the I/O thread to a cpu\n"
+        "  -N <n>      fleet mode: poll every attached reader from n worker threads\n"
+        "  -W <us>     reordering window of the fleet event merge (default 500)\n"
+        "  -p          report ARRIVED/DEPARTED presence changes instead of every read\n"
+        "  -H <ms>     presence hold: DEPARTED after this long without a read (default 300)\n"
+        "  -D <ms>     presence debounce: ARRIVED after a tag was read this long (default 0)\n"
+        "  -K <k/n>    only report an id once k of the reader's last n answers agree\n"
+        "  -A <ms>     back polling off up to this gap while no tag is present, print\n"
+        "              bus utilization and detection latency per level at exit\n"
+        "  -t <file>   per reader timing profile, loaded at startup\n"
+        "  -c          calibrate the command gaps against a test tag (-f to include writes)\n"
+        "              and save them to the -t profile\n"
+        "  -d <dev>    open this reader without scanning the bus: a USB path (1-1.2),\n"
+        "              a device node (/dev/bus/usb/001/004) or an open fd (fd:3)\n"
+        "  -u <file>   remember the reader's USB path here and open it directly next time\n"
+        "  -R <path>   take the reader, clients and state over from the server on <path>\n"
+        "  -F <file>   flight recorder dump, written on SIGUSR1, a crash or a dead reader\n"
+        "              (default /tmp/rfid_reader.<pid>.flight)\n"
+        "  -X <file>   print a flight recorder dump and exit\n"
+        "  -O <file>   capture all reader traffic to a pcap file (usbmon link type)\n"
+        "  -M <file>   write Prometheus metrics to <file> every 5 s and at exit\n"
+        "  -J <file>   trace every USB transfer as Chrome trace event JSON (Perfetto)\n"
+#ifdef RFID_SIM
+        "  -B <n>      benchmark n reads per simulated fault kind and rate\n"
+        "  -L <n,...>  with -N: scale test at each number of simulated readers\n"
+#endif
+        );
 }
 
 
@@ -253,11 +4786,33 @@ int main(int argc, char** argv) {
     int option = 0;
     int read_device = 0;	
 	int buzzer = 0;    
+    int format = AUTO_FORMAT;
+    char *write_string = NULL;
+    char *server_path = NULL;
+    char *ring_name = NULL;
+    int threaded = 0;
+    int io_cpu = -1;
+    int fleet_workers = 0;
+    int calibrate_device = 0;
+    char *device = NULL;
+    char *path_cache = NULL;
+    int from_cache = 0;
+    char *takeover = NULL;
+    char takeover_dev[16];
+    char *capture_path = NULL;
+    char *trace_path = NULL;
+#ifdef RFID_SIM
+    int bench_reads = 0;
+    char *scale_points = NULL;
+#endif
+    int i;
+    uint64_t start_ns = monotonic_ns();
+    struct sigaction sa;
 
-    while ((option = getopt(argc, argv,"vrb")) != -1) {
+    while ((option = getopt(argc, argv,"vrbw:f:S:P:TC:N:W:pH:D:K:A:t:cd:u:R:F:X:O:M:J:h" SIM_OPTIONS)) != -1) {
         switch (option) {
             case 'v' : 
-                verbose = 1;
+                log_level = LOG_DEBUG;
                 break;
             case 'r' : 
                 read_device = 1;
@@ -265,13 +4820,129 @@ int main(int argc, char** argv) {
             case 'b' : 
                 buzzer = 1;
                 break;            
+            case 'w' :
+                write_string = optarg;
+                break;
+            case 'f' :
+                format = atoi(optarg);
+                break;
+            case 'S' :
+                server_path = optarg;
+                break;
+            case 'P' :
+                ring_name = optarg;
+                break;
+            case 'T' :
+                threaded = 1;
+                break;
+            case 'C' :
+                io_cpu = atoi(optarg);
+                break;
+            case 'N' :
+                fleet_workers = atoi(optarg);
+                break;
+            case 'W' :
+                merge_window_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'p' :
+                presence_enabled = 1;
+                break;
+            case 'H' :
+                presence_hold_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'D' :
+                presence_debounce_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'K' :
+                if (sscanf(optarg, "%d/%d", &vote_k, &vote_n) != 2
+                        || vote_n < 1 || vote_n > VOTE_MAX_N || vote_k < 1 || vote_k > vote_n) {
+                    fprintf(stderr, "-K expects k/n with 1 <= k <= n <= %d\n", VOTE_MAX_N);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'A' :
+                poll_init(strtoul(optarg, NULL, 0));
+                /* the per level report is logged at info */
+                if (log_level < LOG_INFO)
+                    log_level = LOG_INFO;
+                break;
+            case 't' :
+                timing_path = optarg;
+                break;
+            case 'c' :
+                calibrate_device = 1;
+                break;
+            case 'd' :
+                device = optarg;
+                break;
+            case 'u' :
+                path_cache = optarg;
+                break;
+            case 'R' :
+                takeover = optarg;
+                break;
+            case 'F' :
+                snprintf(flight_path, sizeof(flight_path), "%s", optarg);
+                break;
+            case 'X' :
+                exit(flight_print(optarg) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+            case 'O' :
+                capture_path = optarg;
+                break;
+            case 'M' :
+                metrics_path = optarg;
+                break;
+            case 'J' :
+                trace_path = optarg;
+                break;
+#ifdef RFID_SIM
+            case 'B' :
+                bench_reads = atoi(optarg);
+                break;
+            case 'L' :
+                scale_points = optarg;
+                break;
+#endif
+            case 'h' :
+                print_usage();
+                exit(EXIT_SUCCESS);
             default: read_device = 1;
                 break;
         }
     }
 
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (!flight_path[0])
+        snprintf(flight_path, sizeof(flight_path), "/tmp/rfid_reader.%d.flight", (int)getpid());
+    sa.sa_handler = flight_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = lat_signal;
+    sigaction(SIGUSR2, &sa, NULL);
+    sa.sa_handler = flight_crash;
+    sa.sa_flags = SA_RESETHAND;
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+    sigaction(SIGFPE, &sa, NULL);
+    sigaction(SIGILL, &sa, NULL);
+    sigaction(SIGABRT, &sa, NULL);
     
-    if (verbose) fprintf(stdout, "Init usb\n");
+    log_debug("Init usb");
+
+    if (takeover) {
+        if (handover_receive(takeover) < 0)
+            exit(EXIT_FAILURE);
+        snprintf(takeover_dev, sizeof(takeover_dev), "fd:%d", dev_fd);
+        device = takeover_dev;
+        if (!server_path)
+            server_path = takeover;
+    }
+    if (!device && path_cache && (device = path_cache_load(path_cache)))
+        from_cache = 1;
 
     /* Init USB */
     r = libusb_init(NULL);
@@ -279,14 +4950,47 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Failed to initialise libusb\n");
         exit(1);
     }
+    if (capture_path)
+        capture_open(capture_path);
+    if (trace_path)
+        trace_open(trace_path);
 
-    libusb_device **devs;
-    ssize_t n = libusb_get_device_list(NULL, &devs);
-    
-    struct libusb_device_handle *reader1 = NULL;
-    struct libusb_device_handle *reader2 = NULL;
+    if (fleet_workers) {
+        /* the workers open the readers in their own contexts */
+        if (ring_name && ring_create(ring_name) < 0)
+            ring_name = NULL;
+#ifdef RFID_SIM
+        if (scale_points)
+            sim_scale(scale_points, fleet_workers);
+        else
+#endif
+        if (fleet_init(fleet_workers) < 0)
+            fprintf(stderr, "could not set up %d fleet workers\n", fleet_workers);
+        else
+            run_server(NULL, server_path);
+        lat_report();
+        if (metrics_path)
+            metrics_write();
+        ring_destroy(ring_name);
+        capture_close();
+        trace_close();
+        libusb_exit(NULL);
+        return 0;
+    }
 
+    libusb_device **devs = NULL;
+    ssize_t n = 0;
+    struct reader reader1 = {0};
     int num_dev = 0;
+
+    if (device && open_fast(device, &reader1.devh) < 0) {
+        fprintf(stderr, "could not open reader %s\n", device);
+        if (!from_cache)
+            goto out;
+    }
+    if (!reader1.devh)
+        n = libusb_get_device_list(NULL, &devs);
+
     for(int i=0; i<n; i++){
         struct libusb_device_descriptor desc;
         r = libusb_get_device_descriptor(devs[i], &desc);
@@ -295,47 +4999,120 @@ int main(int argc, char** argv) {
         }
         if(desc.idVendor == 0x6688){
             num_dev++;
-            libusb_open(devs[i], &reader1);
+            libusb_open(devs[i], &reader1.devh);
         }
     }
 
-    if (verbose) fprintf(stdout, "Found %d readers\n", num_dev);
+    if (devs)
+        log_debug("Found %d readers", num_dev);
 
-    if (!reader1) {
-        if (verbose) fprintf(stdout, "USB device open failed\n");
+    if (!reader1.devh) {
+        log_debug("USB device open failed");
         goto out;
     }
-    if (verbose) fprintf(stdout, "Successfully found the RFID R/W device\n");
+    if (devs && path_cache)
+        path_cache_save(path_cache, libusb_get_device(reader1.devh));
+    log_debug("reader open %llu us after start",
+              (unsigned long long)(monotonic_ns() - start_ns) / 1000);
+    log_debug("Successfully found the RFID R/W device");
 
-    r = libusb_detach_kernel_driver(reader1, 0);
+    r = libusb_detach_kernel_driver(reader1.devh, 0);
     if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND && r != LIBUSB_ERROR_NOT_SUPPORTED) {
         fprintf(stderr, "libusb_detach_kernel_driver error %d\n", r);
         goto out;
     }
 
 
-    r = libusb_claim_interface(reader1, 0);
+    r = libusb_claim_interface(reader1.devh, 0);
     if (r < 0) {
         fprintf(stderr, "libusb_claim_interface error %d\n", r);
         goto out;
     }
 
-    init_protocol(reader1);
+    /* a handed over reader has no command in flight, nothing to drain */
+    if (takeover)
+        arm_in(&reader1);
+    else
+        init_protocol(&reader1);
+    /* only the single reader reopens itself, the fleet re-attaches */
+    usb_path_string(libusb_get_device(reader1.devh), reader1.recover.path, sizeof(reader1.recover.path));
+    timing_load(&reader1, libusb_get_device(reader1.devh));
+    if (takeover)
+        handover_restore(&reader1);
+
+    if (calibrate_device && calibrate(&reader1, format) == 0 && timing_path)
+        timing_save(&reader1, libusb_get_device(reader1.devh));
 
     if (read_device) {
-        send_read_em4100id(reader1);
+        send_read_em4100id(&reader1);
     }
     
     if (buzzer) {
-        send_buzzer(reader1);
+        send_buzzer(&reader1, 9);
+    }
+
+#ifdef RFID_SIM
+    if (bench_reads > 0)
+        sim_bench(&reader1, bench_reads);
+#endif
+
+    if (write_string) {
+        uint8_t hex_buf[5];
+        if (hex_string_to_bytes(write_string, hex_buf) < 0)
+            fprintf(stderr, "invalid id '%s', expected 10 hex digits\n", write_string);
+        else
+            send_write_em4100id(&reader1, hex_buf, format);
+    }
+
+    if (ring_name && ring_create(ring_name) < 0)
+        ring_name = NULL;
+    if (!ring && ring_consumers) {
+        /* handed ring consumers over, but this process does not publish */
+        for (i=0 ; i<RFID_RING_MAX_CONSUMERS ; i++)
+            if (ring_consumers & (1u << i))
+                close(ring_efd[i]);
+        ring_consumers = 0;
+    }
+    /* clients whose consumer was not kept have to attach again */
+    for (i=0 ; i<num_clients ; i++)
+        if (clients[i].ring_idx >= RFID_RING_MAX_CONSUMERS || (clients[i].ring_idx >= 0
+                && !(ring_consumers & (1u << clients[i].ring_idx))))
+            clients[i].ring_idx = -1;
+
+    if (threaded && io_init(&reader1, io_cpu) < 0) {
+        fprintf(stderr, "could not set up the I/O thread\n");
+        threaded = 0;
+    }
+
+    if (server_path || ring_name || threaded || presence_enabled) {
+        run_server(&reader1, server_path);
+        poll_report(&reader1);
+        recover_report(&reader1);
+        lat_report();
+    } else if (log_on(LOG_DEBUG)) {
+        lat_report();
     }
 
-    if (verbose) fprintf(stdout, "uninit\n");
+    /* after a handover the ring lives on in the new process */
+    ring_destroy(handed_over ? NULL : ring_name);
+
+    log_debug("uninit");
 
-    libusb_release_interface(reader1, 0);
+    if (reader1.devh)
+        libusb_release_interface(reader1.devh, 0);
+    free(reader1.cmdq);
+    if (metrics_path)
+        metrics_write();
 out:
-    libusb_free_device_list(devs, 1);    
-    libusb_close(reader1);
+    if (devs)
+        libusb_free_device_list(devs, 1);
+    libusb_close(reader1.devh);
+    if (fast_fd >= 0)
+        close(fast_fd);
+    else if (takeover && dev_fd >= 0)
+        close(dev_fd);
+    capture_close();
+    trace_close();
     libusb_exit(NULL);
 
 }
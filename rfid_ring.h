@@ -0,0 +1,91 @@
+#ifndef RFID_RING_H
+#define RFID_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+ * Shared memory tag event ring published by rfid_reader -P <name>.
+
+ The producer maps /dev/shm/<name> and appends fixed size events; any number
+ of local consumers map it (read-write, for waiting[]) and follow the ring on
+ their own, the producer never waits for them. A consumer that falls more than `slots`
+ events behind loses the oldest ones (rfid_ring_read reports the gap).
+
+ Every slot carries a sequence word: odd while the producer rewrites it,
+ 2*(index+1) once event `index` is complete. Consumers copy the slot and
+ check the word again to detect a concurrent overwrite.
+
+ Wakeups: a consumer attached through the server socket (RFID_REQ_RING_ATTACH)
+ receives its own eventfd and a consumer index. Before blocking on the
+ eventfd it sets waiting[index]; the producer only signals consumers that
+ asked for it, so a busy consumer costs the producer no syscall.
+*/
+
+#define RFID_RING_MAGIC             0x44494652      /* "RFID" */
+#define RFID_RING_VERSION           1
+#define RFID_RING_MAX_CONSUMERS     32
+
+/* rfid_tag_event.flags; without either flag the event is a plain read */
+#define RFID_EVENT_ARRIVED          0x01    /* presence mode: tag appeared */
+#define RFID_EVENT_DEPARTED         0x02    /* presence mode: tag left */
+
+struct rfid_tag_event {
+    uint64_t timestamp_ns;      /* CLOCK_MONOTONIC */
+    uint32_t reader;
+    uint16_t attempts;          /* round trips spent on this read */
+    uint8_t id[5];              /* EM4100 id, answer[5..9] */
+    uint8_t flags;
+};
+
+struct rfid_ring_slot {
+    _Atomic uint64_t seq;
+    struct rfid_tag_event ev;
+};
+
+struct rfid_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;             /* power of two */
+    uint32_t slot_size;
+    _Atomic uint64_t head __attribute__((aligned(64)));    /* events published */
+    _Atomic uint32_t waiting[RFID_RING_MAX_CONSUMERS] __attribute__((aligned(64)));
+    struct rfid_ring_slot slot[] __attribute__((aligned(64)));
+};
+
+static inline size_t rfid_ring_size(uint32_t slots) {
+    return sizeof(struct rfid_ring) + (size_t)slots * sizeof(struct rfid_ring_slot);
+}
+
+/* Fetch the event at *tail. Returns 1 and advances *tail when one was read,
+ * 0 when the consumer is up to date. If the producer lapped the consumer,
+ * *tail jumps forward and *lost (if given) counts the skipped events. */
+static inline int rfid_ring_read(struct rfid_ring *r, uint64_t *tail,
+                                 struct rfid_tag_event *ev, uint64_t *lost) {
+    uint64_t head, seq;
+    struct rfid_ring_slot *s;
+
+    for (;;) {
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (*tail == head)
+            return 0;
+        if (head - *tail > r->slots) {
+            if (lost)
+                *lost += head - r->slots - *tail;
+            *tail = head - r->slots;
+        }
+        s = &r->slot[*tail & (r->slots - 1)];
+        seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        memcpy(ev, &s->ev, sizeof(*ev));
+        atomic_thread_fence(memory_order_acquire);
+        if (seq == 2 * (*tail + 1)
+                && atomic_load_explicit(&s->seq, memory_order_relaxed) == seq) {
+            (*tail)++;
+            return 1;
+        }
+        /* overwritten while copying, resync against the new head */
+    }
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef RFID_SERVER_H
+#define RFID_SERVER_H
+
+#include <stdint.h>
+
+/*
+ * Wire format of the rfid_reader server socket (rfid_reader -S <path>).
+
+ Every message, in both directions, is a 2 byte header followed by the payload:
+
+ 00     XX      message type
+ 01     XX      payload size (0..RFID_SRV_MAX_PAYLOAD)
+ 02+    XX      payload
+
+ Each request is answered with exactly one reply, in order, except that
+ device requests (READ, BUZZER, WRITE) are queued for the reader: reads are
+ served before writes, and a buzzer is acknowledged as soon as it is queued
+ (it is dropped if it cannot sound within a few hundred ms). Subscribed
+ clients additionally receive RFID_EVT_TAG frames, interleaved with replies,
+ whenever the reader sees a tag. Multi byte fields are in host byte order.
+*/
+
+#define RFID_SRV_HDR_SIZE       2
+#define RFID_SRV_MAX_PAYLOAD    32
+
+/* Requests (client to server) */
+#define RFID_REQ_READ           0x01    /* (0 bytes) */
+#define RFID_REQ_BUZZER         0x02    /* (1 byte): 1-9, buzzer duration */
+#define RFID_REQ_WRITE          0x03    /* (6 bytes): format (1 T5577, 2 EM4305), 5 byte id */
+#define RFID_REQ_SUBSCRIBE      0x04    /* (0 bytes) */
+#define RFID_REQ_UNSUBSCRIBE    0x05    /* (0 bytes) */
+#define RFID_REQ_RING_ATTACH    0x06    /* (0 bytes): needs -P, see rfid_ring.h */
+#define RFID_REQ_CANCEL         0x07    /* (0 bytes): drop own queued device requests */
+#define RFID_REQ_HANDOVER       0x08    /* (0 bytes): rfid_reader -R only; answered with the
+                                           reader's fds and private state, not a frame, which
+                                           the new process confirms with RFID_RSP_OK */
+
+/* Replies and events (server to client) */
+#define RFID_RSP_OK             0x80    /* (0 bytes); CANCEL: (1 byte) requests dropped */
+#define RFID_RSP_ERROR          0x81    /* (1 byte): RFID_ERR_* */
+#define RFID_RSP_TAG            0x82    /* (5 bytes): EM4100 id */
+#define RFID_RSP_NOTAG          0x83    /* (0 bytes) */
+#define RFID_RSP_RING           0x84    /* (1 byte): ring consumer index, eventfd via SCM_RIGHTS */
+#define RFID_EVT_TAG            0x90    /* struct rfid_srv_tag_event */
+
+#define RFID_ERR_UNKNOWN        0x01    /* unknown request type */
+#define RFID_ERR_INVALID        0x02    /* malformed payload */
+#define RFID_ERR_UNAVAILABLE    0x03    /* feature not enabled on this server, or the reader failed */
+#define RFID_ERR_BUSY           0x04    /* out of consumer or queue slots */
+#define RFID_ERR_CANCELLED      0x05    /* dropped by RFID_REQ_CANCEL */
+#define RFID_ERR_EXPIRED        0x06    /* could not start before its deadline */
+#define RFID_ERR_TIMEOUT        0x07    /* the reader did not answer */
+
+struct rfid_srv_tag_event {
+    uint64_t timestamp_ns;      /* CLOCK_MONOTONIC */
+    uint8_t reader;
+    uint8_t attempts;           /* round trips spent on this read */
+    uint8_t id[5];
+    uint8_t flags;              /* RFID_EVENT_* from rfid_ring.h */
+} __attribute__((packed));
+
+#endif
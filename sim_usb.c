@@ -0,0 +1,1005 @@
+#define _GNU_SOURCE
+#define SIM_USB_IMPL
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "libusb.h"
+#include "sim_usb.h"
+
+/*
+ * Simulated readers, see sim_usb.h. Every context keeps its scheduled
+ * transfer completions in a list; libusb_handle_events* run the ones that
+ * are due and otherwise wait (or, on the virtual clock, jump) to the next.
+ * A reader answers each OUT frame after answer_us; the answer completes
+ * the IN transfer the host left pending, or waits in the reader until one
+ * is submitted, the way the hardware holds unread reports.
+ */
+#define SIM_VENDOR_ID           0x6688
+#define SIM_PRODUCT_ID          0x6850
+#define SIM_ENDPOINT_IN         0x85
+#define SIM_ENDPOINT_OUT        0x03
+#define SIM_MAX_READERS         1024
+#define SIM_REPORTS             8       /* answers a reader holds for the host */
+#define SIM_PENDING_IN          4
+#define SIM_LOOKAHEAD           8       /* recorded exchanges searched for a command */
+#define SIM_START_NS            1000000000000ull
+
+struct sim_report {
+    uint8_t data[48];
+    int len;
+    int status;                         /* libusb_transfer_status */
+    uint64_t ready_ns;
+};
+
+/* One recorded command and what came back */
+struct sim_xchg {
+    uint8_t out[24];
+    int out_status;
+    uint32_t out_us;
+    int answered;                       /* 0: no answer was recorded */
+    struct sim_report in;
+    uint32_t in_us;                     /* answer, from the OUT submit */
+};
+
+/* What the reader will do with one OUT frame */
+struct sim_plan {
+    int out_status;
+    uint32_t out_us;
+    int answer;
+    uint32_t answer_us;                 /* after the OUT completed */
+    struct sim_report r;
+};
+
+struct sim_dev {
+    int idx;
+    uint8_t bus, addr, ports[2];
+    int tag;
+    uint8_t id[5];
+    uint64_t rand;
+    struct libusb_device_handle *owner;
+    uint32_t gen;                       /* plugged in again: old handles are dead */
+    uint64_t gone_until_ns;             /* unplugged (nodev fault) */
+    int halted;                         /* OUT endpoint stalled until cleared */
+    struct libusb_transfer *in[SIM_PENDING_IN];
+    int nin;
+    struct sim_report report[SIM_REPORTS];
+    int nreports;
+    /* replay */
+    struct sim_xchg *x;
+    int nx, pos, done;
+    uint64_t replayed, diverged, skipped;
+};
+
+struct libusb_device {
+    struct sim_dev *dev;
+    libusb_context *ctx;
+};
+
+struct libusb_device_handle {
+    struct libusb_device d;
+    uint32_t gen;
+};
+
+struct sim_event {
+    struct libusb_transfer *xfr;
+    uint64_t due_ns;
+    int status;
+    int len;
+    uint8_t data[48];                   /* IN: the answer */
+    struct sim_plan plan;               /* OUT: what follows it */
+};
+
+struct libusb_context {
+    pthread_mutex_t lock;
+    struct sim_event *ev;
+    int nev, maxev;
+};
+
+static struct libusb_context sim_default_ctx = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sim_dev *sim_devs;
+static int sim_readers = 1;
+static int sim_allocated;               /* sim_devs entries, >= sim_readers */
+static double sim_tag = 1.0;
+static uint32_t sim_out_us = 1000;
+static uint32_t sim_answer_us = 2000;
+static uint32_t sim_jitter_us = 0;
+static uint64_t sim_seed = 1;
+static int sim_virtual = 1;
+static char *sim_replay;
+static int sim_replay_left;
+static double sim_fault[SIM_FAULTS];
+static uint32_t sim_delay_us = 50000;
+static uint32_t sim_nodev_ms = 100;
+static _Atomic uint64_t sim_ns = SIM_START_NS;
+
+const char *sim_fault_names[SIM_FAULTS] = {"drop", "delay", "checksum", "marker", "truncate", "stall", "nodev"};
+static uint64_t sim_wall_start;
+
+static uint64_t real_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t sim_now(void) {
+    return sim_virtual ? atomic_load(&sim_ns) : real_ns();
+}
+
+/* Let time pass until t: jump there on the virtual clock, sleep otherwise */
+static void sim_wait_until(uint64_t t) {
+    uint64_t now;
+    struct timespec ts;
+
+    if (sim_virtual) {
+        now = atomic_load(&sim_ns);
+        while (now < t && !atomic_compare_exchange_weak(&sim_ns, &now, t))
+            ;
+        return;
+    }
+    ts.tv_sec = t / 1000000000;
+    ts.tv_nsec = t % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+int sim_clock_gettime(clockid_t clk, struct timespec *ts) {
+    uint64_t t;
+
+    if (clk != CLOCK_MONOTONIC || !sim_virtual)
+        return clock_gettime(clk, ts);
+    t = atomic_load(&sim_ns);
+    ts->tv_sec = t / 1000000000;
+    ts->tv_nsec = t % 1000000000;
+    return 0;
+}
+
+int sim_nanosleep(const struct timespec *req, struct timespec *rem) {
+    if (!sim_virtual)
+        return nanosleep(req, rem);
+    sim_wait_until(sim_now() + req->tv_sec * 1000000000ull + req->tv_nsec);
+    return 0;
+}
+
+int sim_usleep(useconds_t usec) {
+    if (!sim_virtual)
+        return usleep(usec);
+    sim_wait_until(sim_now() + usec * 1000ull);
+    return 0;
+}
+
+/* Ready descriptors win; otherwise the timeout passes on the virtual clock */
+int sim_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo, const sigset_t *mask) {
+    struct timespec zero = {0, 0};
+    int r;
+
+    if (!sim_virtual || !tmo)
+        return ppoll(fds, nfds, tmo, mask);
+    r = ppoll(fds, nfds, &zero, mask);
+    if (r == 0)
+        sim_wait_until(sim_now() + tmo->tv_sec * 1000000000ull + tmo->tv_nsec);
+    return r;
+}
+
+static uint64_t sim_random(struct sim_dev *d) {
+    /* xorshift64*, one stream per reader so threads do not share state */
+    d->rand ^= d->rand >> 12;
+    d->rand ^= d->rand << 25;
+    d->rand ^= d->rand >> 27;
+    return d->rand * 2685821657736338717ull;
+}
+
+static double sim_uniform(struct sim_dev *d) {
+    return (sim_random(d) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Frame an answer the way the reader does: 05 01 size cmd status payload xor 04 */
+static void sim_frame(struct sim_report *r, uint8_t cmd, const uint8_t *payload, int len) {
+    int i, x = 0;
+
+    memset(r->data, 0, sizeof(r->data));
+    r->data[0] = 0x05;
+    r->data[1] = 0x01;
+    r->data[2] = 5 + len + 1;
+    r->data[3] = cmd;
+    memcpy(&r->data[5], payload, len);
+    for (i=1 ; i<5+len ; i++)
+        x ^= r->data[i];
+    r->data[5+len] = x;
+    r->data[6+len] = 0x04;
+    r->len = 48;
+    r->status = LIBUSB_TRANSFER_COMPLETED;
+}
+
+static void sim_model(struct sim_dev *d, const uint8_t *out, struct sim_plan *p) {
+    static const uint8_t support[] = {0x00, 0x01, 0x03, 0x10, 0x12, 0x13};
+    uint8_t cmd = out[3];
+
+    memset(p, 0, sizeof(*p));
+    p->out_status = LIBUSB_TRANSFER_COMPLETED;
+    p->out_us = sim_out_us;
+    p->answer = 1;
+    p->answer_us = sim_answer_us + (sim_jitter_us ? sim_random(d) % sim_jitter_us : 0);
+    if (cmd == 0x00)
+        sim_frame(&p->r, 0x80, support, sizeof(support));
+    else if (cmd == 0x10 && d->tag)
+        sim_frame(&p->r, 0x90, d->id, 5);
+    else
+        sim_frame(&p->r, cmd | 0x80, NULL, 0);
+}
+
+static void sim_replay_finished(struct sim_dev *d) {
+    int left;
+
+    if (d->done)
+        return;
+    d->done = 1;
+    pthread_mutex_lock(&sim_lock);
+    left = --sim_replay_left;
+    pthread_mutex_unlock(&sim_lock);
+    if (!left)
+        raise(SIGINT);
+}
+
+/* The recorded exchange for this command, looked for a few ahead */
+static void sim_replay_plan(struct sim_dev *d, const uint8_t *out, struct sim_plan *p) {
+    struct sim_xchg *x;
+    int j;
+
+    for (j=d->pos ; j<d->nx && j<d->pos+SIM_LOOKAHEAD ; j++)
+        if (!memcmp(&d->x[j].out[1], &out[1], 23))
+            break;
+    if (j == d->nx || j == d->pos + SIM_LOOKAHEAD) {
+        d->diverged++;
+        sim_model(d, out, p);
+    } else {
+        x = &d->x[j];
+        d->skipped += j - d->pos;
+        d->pos = j + 1;
+        d->replayed++;
+        memset(p, 0, sizeof(*p));
+        p->out_status = x->out_status;
+        p->out_us = x->out_us;
+        p->answer = x->answered;
+        p->answer_us = x->in_us > x->out_us ? x->in_us - x->out_us : 0;
+        p->r = x->in;
+    }
+    if (d->pos >= d->nx)
+        sim_replay_finished(d);
+}
+
+void sim_set_fault(int fault, double p) {
+    sim_fault[fault] = p;
+}
+
+static int sim_hit(struct sim_dev *d, int fault) {
+    return sim_fault[fault] > 0 && sim_uniform(d) < sim_fault[fault];
+}
+
+static void sim_unplug(struct sim_dev *d, libusb_context *ctx);
+
+/* Spoil the plan with the configured faults, one draw per fault kind */
+static void sim_inject(struct sim_dev *d, libusb_context *ctx, struct sim_plan *p) {
+    int size = p->r.data[2];
+
+    if (sim_hit(d, SIM_FAULT_STALL))
+        d->halted = 1;
+    if (d->halted) {
+        p->out_status = LIBUSB_TRANSFER_STALL;
+        p->answer = 0;
+        return;
+    }
+    if (sim_hit(d, SIM_FAULT_NODEV)) {
+        sim_unplug(d, ctx);
+        p->out_status = LIBUSB_TRANSFER_NO_DEVICE;
+        p->answer = 0;
+        return;
+    }
+    if (!p->answer || p->r.status != LIBUSB_TRANSFER_COMPLETED)
+        return;
+    if (sim_hit(d, SIM_FAULT_DROP))
+        p->answer = 0;
+    if (sim_hit(d, SIM_FAULT_DELAY))
+        p->answer_us += sim_delay_us;
+    if (sim_hit(d, SIM_FAULT_CHECKSUM) && size > 0 && size < 48)
+        p->r.data[size - 1] ^= 0x5a;
+    if (sim_hit(d, SIM_FAULT_MARKER) && size < 48)
+        p->r.data[size] = 0;
+    if (sim_hit(d, SIM_FAULT_TRUNCATE))
+        p->r.len = 1 + sim_random(d) % (p->r.len - 1);
+}
+
+static void sim_plan(struct sim_dev *d, libusb_context *ctx, const uint8_t *out, struct sim_plan *p) {
+    if (d->x)
+        sim_replay_plan(d, out, p);
+    else
+        sim_model(d, out, p);
+    sim_inject(d, ctx, p);
+}
+
+static void sim_schedule(libusb_context *ctx, struct sim_event *e) {
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->nev == ctx->maxev) {
+        ctx->maxev = ctx->maxev ? ctx->maxev * 2 : 16;
+        ctx->ev = realloc(ctx->ev, ctx->maxev * sizeof(*ctx->ev));
+    }
+    ctx->ev[ctx->nev++] = *e;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void sim_complete_in(libusb_context *ctx, struct libusb_transfer *xfr,
+                            const struct sim_report *r, uint64_t due) {
+    struct sim_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.xfr = xfr;
+    e.due_ns = due;
+    e.status = r->status;
+    e.len = r->len < xfr->length ? r->len : xfr->length;
+    memcpy(e.data, r->data, e.len);
+    sim_schedule(ctx, &e);
+}
+
+/* An answer is ready: complete a waiting IN or keep it in the reader */
+static void sim_deliver(struct sim_dev *d, libusb_context *ctx, const struct sim_report *r) {
+    if (d->nin) {
+        sim_complete_in(ctx, d->in[0], r, r->ready_ns);
+        memmove(&d->in[0], &d->in[1], --d->nin * sizeof(d->in[0]));
+    } else if (d->nreports < SIM_REPORTS) {
+        d->report[d->nreports++] = *r;
+    }
+}
+
+static struct sim_report sim_take_report(struct sim_dev *d) {
+    struct sim_report r = d->report[0];
+
+    memmove(&d->report[0], &d->report[1], --d->nreports * sizeof(d->report[0]));
+    return r;
+}
+
+static int sim_gone(struct sim_dev *d) {
+    return d->gone_until_ns > sim_now();
+}
+
+static int sim_dead(libusb_device_handle *h) {
+    return h->gen != h->d.dev->gen || sim_gone(h->d.dev);
+}
+
+/* The reader drops off the bus for nodev_ms: whatever is in flight fails
+ * now, and the handle stays dead when it comes back */
+static void sim_unplug(struct sim_dev *d, libusb_context *ctx) {
+    struct sim_event e;
+    int i;
+
+    d->gen++;
+    d->gone_until_ns = sim_now() + sim_nodev_ms * 1000000ull;
+    d->nreports = 0;
+    d->halted = 0;
+    pthread_mutex_lock(&ctx->lock);
+    for (i=0 ; i<ctx->nev ; i++) {
+        if (ctx->ev[i].xfr->dev_handle->d.dev == d) {
+            ctx->ev[i].status = LIBUSB_TRANSFER_NO_DEVICE;
+            ctx->ev[i].len = 0;
+            ctx->ev[i].plan.answer = 0;
+            ctx->ev[i].due_ns = sim_now();
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    memset(&e, 0, sizeof(e));
+    e.due_ns = sim_now();
+    e.status = LIBUSB_TRANSFER_NO_DEVICE;
+    for (i=0 ; i<d->nin ; i++) {
+        e.xfr = d->in[i];
+        sim_schedule(ctx, &e);
+    }
+    d->nin = 0;
+}
+
+static void sim_run_event(struct sim_event *e) {
+    struct libusb_transfer *xfr = e->xfr;
+    struct sim_dev *d = xfr->dev_handle->d.dev;
+    struct sim_report r;
+
+    xfr->status = e->status;
+    if (xfr->endpoint == SIM_ENDPOINT_IN) {
+        xfr->actual_length = e->len;
+        memcpy(xfr->buffer, e->data, e->len);
+    } else {
+        xfr->actual_length = e->status == LIBUSB_TRANSFER_COMPLETED ? xfr->length : 0;
+        if (e->status == LIBUSB_TRANSFER_COMPLETED && e->plan.answer) {
+            r = e->plan.r;
+            r.ready_ns = e->due_ns + e->plan.answer_us * 1000ull;
+            sim_deliver(d, xfr->dev_handle->d.ctx, &r);
+        }
+    }
+    xfr->callback(xfr);
+    if (xfr->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+        libusb_free_transfer(xfr);
+}
+
+/* Run the events due by `deadline`, waiting for the first one. With
+ * nothing scheduled at all it waits for the deadline only if `idle`. */
+static void sim_run(libusb_context *ctx, uint64_t deadline, int idle) {
+    struct sim_event e;
+    uint64_t now, due;
+    int i, first, ran = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        first = -1;
+        for (i=0 ; i<ctx->nev ; i++)
+            if (first < 0 || ctx->ev[i].due_ns < ctx->ev[first].due_ns)
+                first = i;
+        now = sim_now();
+        if (first >= 0 && ctx->ev[first].due_ns <= now) {
+            e = ctx->ev[first];
+            ctx->ev[first] = ctx->ev[--ctx->nev];
+            pthread_mutex_unlock(&ctx->lock);
+            sim_run_event(&e);
+            ran = 1;
+            continue;
+        }
+        due = first >= 0 ? ctx->ev[first].due_ns : 0;
+        pthread_mutex_unlock(&ctx->lock);
+        if (ran || (first < 0 && !idle))
+            return;
+        if (first < 0 || due > deadline) {
+            sim_wait_until(deadline);
+            return;
+        }
+        sim_wait_until(due);
+    }
+}
+
+static int sim_status(int errnum) {
+    switch (-errnum) {
+        case 0:         return LIBUSB_TRANSFER_COMPLETED;
+        case ETIMEDOUT: return LIBUSB_TRANSFER_TIMED_OUT;
+        case ENOENT:
+        case ECONNRESET: return LIBUSB_TRANSFER_CANCELLED;
+        case EPIPE:     return LIBUSB_TRANSFER_STALL;
+        case ENODEV:
+        case ESHUTDOWN: return LIBUSB_TRANSFER_NO_DEVICE;
+        case EOVERFLOW: return LIBUSB_TRANSFER_OVERFLOW;
+        default:        return LIBUSB_TRANSFER_ERROR;
+    }
+}
+
+/* usbmon pcap from rfid_reader -O: one exchange per OUT submit, with the
+ * OUT completion and the next IN completion that was not a cancel */
+#pragma pack(push, 1)
+struct sim_pcap_rec {
+    uint32_t ts_sec, ts_nsec, incl_len, orig_len;
+};
+struct sim_usbmon {
+    uint64_t id;
+    uint8_t type, xfer_type, epnum, devnum;
+    uint16_t busnum;
+    char flag_setup, flag_data;
+    int64_t ts_sec;
+    int32_t ts_usec, status;
+    uint32_t length, len_cap;
+    uint8_t setup[8];
+    int32_t interval, start_frame;
+    uint32_t xfer_flags, ndesc;
+};
+#pragma pack(pop)
+
+static int sim_load_replay(const char *file) {
+    struct sim_pcap_rec rec;
+    struct sim_usbmon mon;
+    struct sim_xchg *x;
+    struct sim_dev *d;
+    uint8_t data[65536];
+    uint32_t magic;
+    uint64_t t, *t0 = NULL;
+    int bus[SIM_MAX_READERS], addr[SIM_MAX_READERS], maxx[SIM_MAX_READERS];
+    int i, n = 0, frames = 0;
+    FILE *f;
+
+    if (!(f = fopen(file, "rb"))) {
+        fprintf(stderr, "sim: could not open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    if (fread(&magic, 4, 1, f) != 1 || magic != 0xa1b23c4d || fseek(f, 24, SEEK_SET) < 0) {
+        fprintf(stderr, "sim: %s is not an rfid_reader -O capture\n", file);
+        fclose(f);
+        return -1;
+    }
+    sim_devs = calloc(SIM_MAX_READERS, sizeof(*sim_devs));
+    t0 = calloc(SIM_MAX_READERS, sizeof(*t0));
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.incl_len < sizeof(mon) || rec.incl_len > sizeof(mon) + sizeof(data)
+                || fread(&mon, sizeof(mon), 1, f) != 1
+                || fread(data, rec.incl_len - sizeof(mon), 1, f) != (rec.incl_len > sizeof(mon)))
+            break;
+        t = rec.ts_sec * 1000000000ull + rec.ts_nsec;
+        for (i=0 ; i<n && (bus[i] != mon.busnum || addr[i] != mon.devnum) ; i++)
+            ;
+        if (i == n) {
+            if (n == SIM_MAX_READERS)
+                continue;
+            bus[n] = mon.busnum;
+            addr[n] = mon.devnum;
+            maxx[n++] = 0;
+        }
+        d = &sim_devs[i];
+        x = d->nx ? &d->x[d->nx - 1] : NULL;
+        if (mon.type == 'S' && mon.epnum == SIM_ENDPOINT_OUT && mon.len_cap >= 24) {
+            if (d->nx == maxx[i]) {
+                maxx[i] = maxx[i] ? maxx[i] * 2 : 64;
+                d->x = realloc(d->x, maxx[i] * sizeof(*d->x));
+            }
+            x = &d->x[d->nx++];
+            memset(x, 0, sizeof(*x));
+            memcpy(x->out, data, 24);
+            t0[i] = t;
+            frames++;
+        } else if (x && mon.type != 'S' && mon.epnum == SIM_ENDPOINT_OUT) {
+            x->out_status = sim_status(mon.status);
+            x->out_us = (t - t0[i]) / 1000;
+        } else if (x && mon.type != 'S' && mon.epnum == SIM_ENDPOINT_IN && !x->answered
+                   && sim_status(mon.status) != LIBUSB_TRANSFER_CANCELLED) {
+            x->answered = 1;
+            x->in.status = sim_status(mon.status);
+            x->in.len = mon.len_cap < 48 ? mon.len_cap : 48;
+            memcpy(x->in.data, data, x->in.len);
+            x->in_us = (t - t0[i]) / 1000;
+        }
+    }
+    fclose(f);
+    free(t0);
+    if (!frames) {
+        fprintf(stderr, "sim: no OUT frames in %s\n", file);
+        return -1;
+    }
+    sim_readers = n;
+    sim_replay_left = n;
+    for (i=0 ; i<n ; i++)
+        if (!sim_devs[i].nx)
+            sim_replay_finished(&sim_devs[i]);
+    fprintf(stderr, "sim: replaying %d commands to %d readers from %s\n", frames, n, file);
+    return 0;
+}
+
+static void sim_init_dev(struct sim_dev *d, int i) {
+    d->idx = i;
+    /* a tree of 8 port hubs, 64 readers per bus */
+    d->bus = 1 + i / 64;
+    d->addr = 2 + i % 64;
+    d->ports[0] = 1 + i % 64 / 8;
+    d->ports[1] = 1 + i % 8;
+    d->rand = (sim_seed + i) * 0x9e3779b97f4a7c15ull | 1;
+    d->tag = sim_uniform(d) < sim_tag;
+    d->id[0] = 0x01;
+    d->id[1] = 0x23;
+    d->id[2] = 0x45;
+    d->id[3] = i >> 8;
+    d->id[4] = i;
+}
+
+static void sim_setup(void) {
+    char *env = getenv("RFID_SIM"), *spec, *tok, *save, *val;
+    int i;
+
+    spec = strdup(env ? env : "");
+    for (tok = strtok_r(spec, ",", &save) ; tok ; tok = strtok_r(NULL, ",", &save)) {
+        if (!(val = strchr(tok, '='))) {
+            fprintf(stderr, "sim: ignoring '%s'\n", tok);
+            continue;
+        }
+        *val++ = 0;
+        if (!strcmp(tok, "readers"))
+            sim_readers = atoi(val);
+        else if (!strcmp(tok, "tag"))
+            sim_tag = atof(val);
+        else if (!strcmp(tok, "out_us"))
+            sim_out_us = atoi(val);
+        else if (!strcmp(tok, "answer_us"))
+            sim_answer_us = atoi(val);
+        else if (!strcmp(tok, "jitter_us"))
+            sim_jitter_us = atoi(val);
+        else if (!strcmp(tok, "clock"))
+            sim_virtual = strcmp(val, "real") != 0;
+        else if (!strcmp(tok, "seed"))
+            sim_seed = strtoull(val, NULL, 0);
+        else if (!strcmp(tok, "replay"))
+            sim_replay = strdup(val);
+        else if (!strcmp(tok, "delay_us"))
+            sim_delay_us = atoi(val);
+        else if (!strcmp(tok, "nodev_ms"))
+            sim_nodev_ms = atoi(val);
+        else {
+            for (i=0 ; i<SIM_FAULTS && strcmp(tok, sim_fault_names[i]) ; i++)
+                ;
+            if (i < SIM_FAULTS)
+                sim_fault[i] = atof(val);
+            else
+                fprintf(stderr, "sim: unknown setting '%s'\n", tok);
+        }
+    }
+    free(spec);
+    if (sim_readers < 1)
+        sim_readers = 1;
+    if (sim_readers > SIM_MAX_READERS)
+        sim_readers = SIM_MAX_READERS;
+    if (sim_replay && sim_load_replay(sim_replay) < 0) {
+        free(sim_replay);
+        sim_replay = NULL;
+        free(sim_devs);
+        sim_devs = NULL;
+    }
+    if (!sim_devs) {
+        sim_devs = calloc(sim_readers, sizeof(*sim_devs));
+        sim_allocated = sim_readers;
+    }
+    for (i=0 ; i<sim_readers ; i++)
+        sim_init_dev(&sim_devs[i], i);
+    sim_wall_start = real_ns();
+}
+
+int sim_set_readers(int n) {
+    struct sim_dev *devs;
+    int i;
+
+    pthread_once(&sim_once, sim_setup);
+    if (sim_replay || n < 1)
+        return sim_readers;
+    if (n > SIM_MAX_READERS)
+        n = SIM_MAX_READERS;
+    if (n > sim_allocated) {
+        /* only while no reader is open: handles point into sim_devs */
+        if (!(devs = realloc(sim_devs, n * sizeof(*devs))))
+            return sim_readers;
+        memset(&devs[sim_allocated], 0, (n - sim_allocated) * sizeof(*devs));
+        for (i=sim_allocated ; i<n ; i++)
+            sim_init_dev(&devs[i], i);
+        sim_devs = devs;
+        sim_allocated = n;
+    }
+    sim_readers = n;
+    return n;
+}
+
+int sim_realtime(void) {
+    pthread_once(&sim_once, sim_setup);
+    return !sim_virtual;
+}
+
+int LIBUSB_CALL libusb_init(libusb_context **ctx) {
+    pthread_once(&sim_once, sim_setup);
+    if (ctx) {
+        *ctx = calloc(1, sizeof(**ctx));
+        pthread_mutex_init(&(*ctx)->lock, NULL);
+    }
+    return 0;
+}
+
+static libusb_context *sim_ctx(libusb_context *ctx) {
+    return ctx ? ctx : &sim_default_ctx;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx) {
+    uint64_t replayed = 0, diverged = 0, skipped = 0;
+    int i;
+
+    if (ctx) {
+        free(ctx->ev);
+        free(ctx);
+        return;
+    }
+    if (!sim_replay)
+        return;
+    for (i=0 ; i<sim_readers ; i++) {
+        replayed += sim_devs[i].replayed;
+        diverged += sim_devs[i].diverged;
+        skipped += sim_devs[i].skipped;
+    }
+    fprintf(stderr, "sim: %llu commands answered from the capture, %llu skipped, %llu not found;"
+            " %.3f s simulated in %.3f s\n", (unsigned long long)replayed,
+            (unsigned long long)skipped, (unsigned long long)diverged,
+            (sim_now() - SIM_START_NS) / 1e9, (real_ns() - sim_wall_start) / 1e9);
+}
+
+int LIBUSB_CALL libusb_set_option(libusb_context *ctx, enum libusb_option option, ...) {
+    (void)ctx; (void)option;
+    return 0;
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+    int i, n = 0;
+
+    *list = calloc(sim_readers + 1, sizeof(**list));
+    for (i=0 ; i<sim_readers ; i++) {
+        if (sim_gone(&sim_devs[i]))
+            continue;
+        (*list)[n] = calloc(1, sizeof(libusb_device));
+        (*list)[n]->dev = &sim_devs[i];
+        (*list)[n++]->ctx = sim_ctx(ctx);
+    }
+    return n;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list, int unref_devices) {
+    int i;
+
+    (void)unref_devices;
+    for (i=0 ; list && list[i] ; i++)
+        free(list[i]);
+    free(list);
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+    (void)dev;
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength = sizeof(*desc);
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->idVendor = SIM_VENDOR_ID;
+    desc->idProduct = SIM_PRODUCT_ID;
+    desc->bNumConfigurations = 1;
+    return 0;
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev) {
+    return dev->dev->bus;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev) {
+    return dev->dev->addr;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len) {
+    if (port_numbers_len < 2)
+        return LIBUSB_ERROR_OVERFLOW;
+    memcpy(port_numbers, dev->dev->ports, 2);
+    return 2;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle) {
+    if (sim_gone(dev->dev))
+        return LIBUSB_ERROR_NO_DEVICE;
+    *dev_handle = calloc(1, sizeof(**dev_handle));
+    (*dev_handle)->d = *dev;
+    (*dev_handle)->gen = dev->dev->gen;
+    return 0;
+}
+
+/* There are no device nodes behind the simulation: any fd is reader 0 */
+int LIBUSB_CALL libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **dev_handle) {
+    (void)sys_dev;
+    pthread_once(&sim_once, sim_setup);
+    *dev_handle = calloc(1, sizeof(**dev_handle));
+    (*dev_handle)->d.dev = &sim_devs[0];
+    (*dev_handle)->d.ctx = sim_ctx(ctx);
+    (*dev_handle)->gen = sim_devs[0].gen;
+    return 0;
+}
+
+libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle) {
+    return &dev_handle->d;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number) {
+    (void)dev_handle; (void)interface_number;
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number) {
+    struct sim_dev *d = dev_handle->d.dev;
+    int r = 0;
+
+    (void)interface_number;
+    if (sim_dead(dev_handle))
+        return LIBUSB_ERROR_NO_DEVICE;
+    pthread_mutex_lock(&sim_lock);
+    if (d->owner && d->owner != dev_handle && d->owner->gen == d->gen)
+        r = LIBUSB_ERROR_BUSY;
+    else
+        d->owner = dev_handle;
+    pthread_mutex_unlock(&sim_lock);
+    return r;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle, int interface_number) {
+    struct sim_dev *d = dev_handle->d.dev;
+
+    (void)interface_number;
+    pthread_mutex_lock(&sim_lock);
+    if (d->owner == dev_handle)
+        d->owner = NULL;
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+/* Transfers still in flight die with the handle, without callbacks */
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle) {
+    libusb_context *ctx;
+    struct sim_dev *d;
+    int i;
+
+    if (!dev_handle)
+        return;
+    ctx = dev_handle->d.ctx;
+    d = dev_handle->d.dev;
+    pthread_mutex_lock(&ctx->lock);
+    for (i=0 ; i<ctx->nev ; ) {
+        if (ctx->ev[i].xfr->dev_handle == dev_handle) {
+            if (ctx->ev[i].xfr->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+                libusb_free_transfer(ctx->ev[i].xfr);
+            ctx->ev[i] = ctx->ev[--ctx->nev];
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    for (i=0 ; i<d->nin ; ) {
+        if (d->in[i]->dev_handle == dev_handle) {
+            if (d->in[i]->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+                libusb_free_transfer(d->in[i]);
+            memmove(&d->in[i], &d->in[i+1], (--d->nin - i) * sizeof(d->in[0]));
+        } else {
+            i++;
+        }
+    }
+    libusb_release_interface(dev_handle, 0);
+    free(dev_handle);
+}
+
+int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev_handle, unsigned char endpoint) {
+    if (sim_dead(dev_handle))
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (endpoint == SIM_ENDPOINT_OUT)
+        dev_handle->d.dev->halted = 0;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev_handle) {
+    if (sim_dead(dev_handle))
+        return LIBUSB_ERROR_NOT_FOUND;
+    dev_handle->d.dev->nreports = 0;
+    dev_handle->d.dev->halted = 0;
+    return 0;
+}
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets) {
+    return calloc(1, sizeof(struct libusb_transfer) + iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer) {
+    if (!transfer)
+        return;
+    if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+        free(transfer->buffer);
+    free(transfer);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer) {
+    libusb_context *ctx = transfer->dev_handle->d.ctx;
+    struct sim_dev *d = transfer->dev_handle->d.dev;
+    struct sim_event e;
+    struct sim_report r;
+    uint64_t now = sim_now();
+
+    if (sim_dead(transfer->dev_handle))
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (transfer->endpoint == SIM_ENDPOINT_IN) {
+        if (d->nreports) {
+            r = sim_take_report(d);
+            sim_complete_in(ctx, transfer, &r, r.ready_ns > now ? r.ready_ns : now);
+        } else if (d->nin < SIM_PENDING_IN) {
+            d->in[d->nin++] = transfer;
+        } else {
+            return LIBUSB_ERROR_BUSY;
+        }
+        return 0;
+    }
+    memset(&e, 0, sizeof(e));
+    e.xfr = transfer;
+    sim_plan(d, ctx, transfer->buffer, &e.plan);
+    e.status = e.plan.out_status;
+    e.due_ns = now + e.plan.out_us * 1000ull;
+    sim_schedule(ctx, &e);
+    return 0;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer) {
+    libusb_context *ctx = transfer->dev_handle->d.ctx;
+    struct sim_dev *d = transfer->dev_handle->d.dev;
+    struct sim_event e;
+    int i;
+
+    for (i=0 ; i<d->nin && d->in[i] != transfer ; i++)
+        ;
+    if (i < d->nin) {
+        memmove(&d->in[i], &d->in[i+1], (--d->nin - i) * sizeof(d->in[0]));
+        memset(&e, 0, sizeof(e));
+        e.xfr = transfer;
+        e.due_ns = sim_now();
+        e.status = LIBUSB_TRANSFER_CANCELLED;
+        sim_schedule(ctx, &e);
+        return 0;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    for (i=0 ; i<ctx->nev && ctx->ev[i].xfr != transfer ; i++)
+        ;
+    if (i < ctx->nev) {
+        ctx->ev[i].status = LIBUSB_TRANSFER_CANCELLED;
+        ctx->ev[i].len = 0;
+        ctx->ev[i].plan.answer = 0;
+        ctx->ev[i].due_ns = sim_now();
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return i < ctx->nev ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed) {
+    (void)completed;
+    sim_run(sim_ctx(ctx), sim_now() + tv->tv_sec * 1000000000ull + tv->tv_usec * 1000ull, 1);
+    return 0;
+}
+
+int LIBUSB_CALL libusb_handle_events(libusb_context *ctx) {
+    /* callers loop on it waiting for a cancel, never for an idle bus */
+    sim_run(sim_ctx(ctx), sim_now() + 60 * 1000000000ull, 0);
+    return 0;
+}
+
+/* Synchronous transfers: the IN takes a report the reader holds, the OUT
+ * is answered into the reader's reports */
+int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+        unsigned char *data, int length, int *actual_length, unsigned int timeout) {
+    struct sim_dev *d = dev_handle->d.dev;
+    uint64_t now = sim_now(), deadline = now + (timeout ? timeout : 60000) * 1000000ull;
+    struct sim_plan p;
+    struct sim_report r;
+
+    *actual_length = 0;
+    if (sim_dead(dev_handle))
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (endpoint == SIM_ENDPOINT_IN) {
+        if (!d->nreports || d->report[0].ready_ns > deadline) {
+            sim_wait_until(deadline);
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        r = sim_take_report(d);
+        sim_wait_until(r.ready_ns);
+        if (r.status != LIBUSB_TRANSFER_COMPLETED)
+            return LIBUSB_ERROR_IO;
+        *actual_length = r.len < length ? r.len : length;
+        memcpy(data, r.data, *actual_length);
+        return 0;
+    }
+    sim_plan(d, dev_handle->d.ctx, data, &p);
+    sim_wait_until(now + p.out_us * 1000ull);
+    if (p.out_status == LIBUSB_TRANSFER_NO_DEVICE)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (p.out_status != LIBUSB_TRANSFER_COMPLETED)
+        return p.out_status == LIBUSB_TRANSFER_STALL ? LIBUSB_ERROR_PIPE : LIBUSB_ERROR_IO;
+    *actual_length = length;
+    if (p.answer) {
+        r = p.r;
+        r.ready_ns = sim_now() + p.answer_us * 1000ull;
+        sim_deliver(d, dev_handle->d.ctx, &r);
+    }
+    return 0;
+}
+
+const char * LIBUSB_CALL libusb_error_name(int errcode) {
+    switch (errcode) {
+        case LIBUSB_SUCCESS:            return "LIBUSB_SUCCESS";
+        case LIBUSB_ERROR_IO:           return "LIBUSB_ERROR_IO";
+        case LIBUSB_ERROR_NO_DEVICE:    return "LIBUSB_ERROR_NO_DEVICE";
+        case LIBUSB_ERROR_NOT_FOUND:    return "LIBUSB_ERROR_NOT_FOUND";
+        case LIBUSB_ERROR_BUSY:         return "LIBUSB_ERROR_BUSY";
+        case LIBUSB_ERROR_TIMEOUT:      return "LIBUSB_ERROR_TIMEOUT";
+        case LIBUSB_ERROR_OVERFLOW:     return "LIBUSB_ERROR_OVERFLOW";
+        case LIBUSB_ERROR_PIPE:         return "LIBUSB_ERROR_PIPE";
+        default:                        return "LIBUSB_ERROR_OTHER";
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef SIM_USB_H
+#define SIM_USB_H
+
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Simulated 0x6688:0x6850 readers behind the libusb API (sim_usb.c).
+ * `make rfid_reader_sim` builds rfid_reader.c with -DRFID_SIM against it
+ * instead of libusb, so every mode runs without hardware.
+
+ The simulation is configured by the RFID_SIM environment variable, a
+ comma separated list of key=value:
+
+ readers=N          simulated readers (default 1)
+ tag=F              fraction of the readers with a tag in the field (default 1)
+ out_us=N           OUT transfer latency (default 1000)
+ answer_us=N        answer latency after the OUT completed (default 2000)
+ jitter_us=N        uniform extra answer latency (default 0)
+ clock=virtual|real (default virtual)
+ seed=N             seed of the per reader random streams
+ replay=FILE        answer from a capture written by rfid_reader -O
+
+ Faults, each the probability per command (default 0):
+
+ drop=P             the answer never comes
+ delay=P            the answer comes delay_us (default 50000) late
+ checksum=P         the answer's checksum byte is flipped
+ marker=P           the answer's end marker is cleared
+ truncate=P         the IN completes with a random actual_length < 48
+ stall=P            the OUT endpoint stalls until the halt is cleared
+ nodev=P            the reader drops off the bus for nodev_ms (default 100)
+                    and has to be opened again
+
+ With the virtual clock CLOCK_MONOTONIC, sleeps and poll timeouts in
+ rfid_reader.c run on simulated time: waiting costs nothing and a run is
+ reproducible. Time only makes sense while one thread drives the readers,
+ so -T and -N need clock=real.
+
+ In replay mode each reader of the capture becomes a simulated reader
+ that answers every command with the recorded answer, recorded latency
+ and recorded errors. A command that is not the next one recorded is
+ looked for a few exchanges ahead, and answered by the model if it is
+ not found. When all recorded exchanges are used up the process gets a
+ SIGINT.
+*/
+
+#define SIM_FAULT_DROP          0
+#define SIM_FAULT_DELAY         1
+#define SIM_FAULT_CHECKSUM      2
+#define SIM_FAULT_MARKER        3
+#define SIM_FAULT_TRUNCATE      4
+#define SIM_FAULT_STALL         5
+#define SIM_FAULT_NODEV         6
+#define SIM_FAULTS              7
+
+extern const char *sim_fault_names[SIM_FAULTS];
+
+void sim_set_fault(int fault, double p);
+/* Plug in readers up to `n` or unplug the ones above it; only while no
+ * reader is open. Returns the number of simulated readers. */
+int sim_set_readers(int n);
+int sim_realtime(void);
+
+int sim_clock_gettime(clockid_t clk, struct timespec *ts);
+int sim_nanosleep(const struct timespec *req, struct timespec *rem);
+int sim_usleep(useconds_t usec);
+int sim_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo, const sigset_t *mask);
+
+#ifndef SIM_USB_IMPL
+#define clock_gettime   sim_clock_gettime
+#define nanosleep       sim_nanosleep
+#define usleep          sim_usleep
+#define ppoll           sim_ppoll
+#endif
+
+#endif